@@ -0,0 +1,98 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <Chip8.hpp>
+
+// Just enough of ELF64 to write a relocatable x86-64 object holding one
+// global symbol, so this builds on hosts without <elf.h> too.
+struct ElfHeader {
+  u8 ident[16];
+  u16 type, machine;
+  u32 version;
+  u64 entry, phoff, shoff;
+  u32 flags;
+  u16 ehsize, phentsize, phnum, shentsize, shnum, shstrndx;
+};
+
+struct ElfSection {
+  u32 name, type;
+  u64 flags, addr, offset, size;
+  u32 link, info;
+  u64 addralign, entsize;
+};
+
+struct ElfSymbol {
+  u32 name;
+  u8 info, other;
+  u16 shndx;
+  u64 value, size;
+};
+
+// Writes data as the read-only, executable contents of symbol. The image
+// needs no relocations: its code only jumps within itself.
+static bool writeObject(const fs::path& path, const std::string& symbol, const std::vector<u8>& data) {
+  enum { Null, Text, Stack, Symtab, Strtab, Shstrtab, Count };
+  const char shstrtab[] = "\0.text.jit8\0.note.GNU-stack\0.symtab\0.strtab\0.shstrtab";
+  std::string strtab = '\0' + symbol + '\0';
+  ElfSymbol symbols[2]{};
+  symbols[1] = {1, 1 << 4 | 1, 0, Text, 0, data.size()}; // STB_GLOBAL, STT_OBJECT
+
+  auto align = [](u64 offset, u64 to) { return (offset + to - 1) & ~(to - 1); };
+  u64 textOffset = align(sizeof(ElfHeader), 64);
+  u64 symtabOffset = align(textOffset + data.size(), 8);
+  u64 strtabOffset = symtabOffset + sizeof(symbols);
+  u64 shstrtabOffset = strtabOffset + strtab.size();
+  u64 sectionsOffset = align(shstrtabOffset + sizeof(shstrtab), 8);
+
+  ElfSection sections[Count]{};
+  sections[Text] = {1, 1, 2 | 4, 0, textOffset, data.size(), 0, 0, 64, 0}; // SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR
+  sections[Stack] = {12, 1, 0, 0, symtabOffset, 0, 0, 0, 1, 0};
+  sections[Symtab] = {28, 2, 0, 0, symtabOffset, sizeof(symbols), Strtab, 1, 8, sizeof(ElfSymbol)};
+  sections[Strtab] = {36, 3, 0, 0, strtabOffset, strtab.size(), 0, 0, 1, 0};
+  sections[Shstrtab] = {44, 3, 0, 0, shstrtabOffset, sizeof(shstrtab), 0, 0, 1, 0};
+
+  ElfHeader header{{0x7f, 'E', 'L', 'F', 2, 1, 1}, 1, 62, 1, 0, 0, sectionsOffset, 0,
+                   sizeof(ElfHeader), 0, 0, sizeof(ElfSection), Count, Shstrtab};
+
+  std::ofstream file(path, std::ios::binary);
+  auto put = [&file](const void* bytes, size_t len) { file.write(reinterpret_cast<const char*>(bytes), len); };
+  auto padTo = [&file](u64 offset) { while (u64(file.tellp()) < offset) file.put(0); };
+  put(&header, sizeof(header));
+  padTo(textOffset);
+  put(data.data(), data.size());
+  padTo(symtabOffset);
+  put(symbols, sizeof(symbols));
+  put(strtab.data(), strtab.size());
+  put(shstrtab, sizeof(shstrtab));
+  padTo(sectionsOffset);
+  put(sections, sizeof(sections));
+  return bool(file);
+}
+
+int main(int argc, char** argv) {
+  if(argc < 3) {
+    printf("Usage: jit8-aot <chip-8 executable> <output object> [symbol]\n");
+    return -1;
+  }
+  fs::path romPath(argv[1]);
+  std::string symbol = argc > 3 ? argv[3] : "jit8_aot_image";
+
+  CoreState core(64 << 20);
+  if(!core.LoadProgram(romPath)) {
+    printf("Failed to read Chip8 program (maybe too big?)\n");
+    return -1;
+  }
+
+  auto image = core.BuildAotImage();
+  if(image.empty()) {
+    printf("Failed to compile the program\n");
+    return -1;
+  }
+  if(!writeObject(argv[2], symbol, image)) {
+    printf("Failed to write %s\n", argv[2]);
+    return -1;
+  }
+  return 0;
+}
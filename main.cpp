@@ -24,6 +24,10 @@ int main(int argc, char** argv) {
     return -1;
   }
 
+  fs::path cacheDir = CoreState::CodeCacheDir();
+  if (!cacheDir.empty()) core.LoadCodeCache(cacheDir);
+  core.Precompile();
+
   SDL_Window* window = SDL_CreateWindow(
     "Jit8",
     SDL_WINDOWPOS_CENTERED,
@@ -39,7 +43,8 @@ int main(int argc, char** argv) {
   bool running = true;
 
   while(running) {
-    core.RunJit();
+    u32 frameStart = SDL_GetTicks();
+    core.RunFrame();
 
     if(core.draw) {
       SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
@@ -63,8 +68,13 @@ int main(int argc, char** argv) {
     while(SDL_PollEvent(&e)) {
       if(e.type == SDL_QUIT) running = false;
     }
+
+    u32 elapsed = SDL_GetTicks() - frameStart;
+    if(elapsed < 1000 / 60) SDL_Delay(1000 / 60 - elapsed);
   }
 
+  if (!cacheDir.empty()) core.SaveCodeCache(cacheDir);
+
   SDL_DestroyRenderer(renderer);
   SDL_DestroyWindow(window);
   SDL_Quit();
@@ -1,59 +1,130 @@
 #include <Chip8.hpp>
+#include <xbyak_util.h>
 #include <fstream>
-#include <vector>
 #include <ctime>
+#include <algorithm>
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #define vx v[x]
 #define vy v[y]
 #define vf v[0xf]
 #define unimplemented(fmt, ...) do { printf("Unimplemented opcode for group " fmt "\n", __VA_ARGS__); exit(1); } while(0)
 
-CoreState::CoreState() {
-  srand(time(nullptr));
+CoreState::CoreState(size_t codeCacheSize) {
   std::copy(std::begin(font), std::end(font), std::begin(ram)+0x50);
-  memset(cache, 0, sizeof(*cache) * BLOCKS_SIZE);
 
-  gen = new Xbyak::CodeGenerator;
+  codeCapacity = std::max(codeCacheSize, kMinCodeCacheSize);
+  gen = new Xbyak::CodeGenerator(codeCapacity);
   gen->setProtectMode(Xbyak::CodeGenerator::PROTECT_RWE);
+  helpers[HelperRand] = (const void*)rand;
+  helpers[HelperDxyn] = memberFunctionAddress(&CoreState::dxyn);
+  helpers[HelperFx55] = memberFunctionAddress(&CoreState::Fx55);
+  helpers[HelperFx65] = memberFunctionAddress(&CoreState::Fx65);
+  helpers[HelperDelayAt] = memberFunctionAddress(&CoreState::DelayAt);
+  helpers[HelperDelayWaitSkip] = memberFunctionAddress(&CoreState::delayWaitSkip);
+  helpers[HelperInvalidateRange] = memberFunctionAddress(&CoreState::invalidateRange);
+  helpers[HelperBlockMiss] = memberFunctionAddress(&CoreState::blockMiss);
+  helpers[HelperJumpCacheMiss] = memberFunctionAddress(&CoreState::jumpCacheMiss);
+  EmitDispatcher();
+  ownStubs = {jitEntry, dispatcher, dispatchExit, smcExit, compileStub};
+  stubsSize = gen->getSize();
+  for (auto& entry : table) entry.store(compileStub, std::memory_order_relaxed);
+  forgetReturns();
+}
+
+CoreState::~CoreState() {
+  StopCompileWorker();
+  delete gen;
 }
 
+// Host CPU features the emitted code depends on, checked along with
+// kJitVersion before persisted code gets used
+enum HostFeature : u32 { FeatureAvx2 = 1 };
+static const u32 hostFeatures = Xbyak::util::Cpu().has(Xbyak::util::Cpu::tAVX2) ? FeatureAvx2 : 0;
+
 static inline std::vector<u8> ReadFileBinary(const std::string& path) {
   std::ifstream file(path, std::ios::binary);
   return {std::istreambuf_iterator{file}, {}};
 }
 
+// FNV-1a, used for ROM keys and block checksums
+static inline u64 hashBytes(const u8* data, size_t len) {
+  u64 hash = 0xcbf29ce484222325;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ data[i]) * 0x100000001b3;
+  }
+  return hash;
+}
+
 bool CoreState::LoadProgram(const fs::path &path) {
   auto binary = ReadFileBinary(path.string());
   if(binary.size() > (0x1000 - 0x200)) return false;
   std::copy(binary.begin(), binary.end(), std::begin(ram)+0x200);
+  // seeded here rather than on construction, as Precompile builds scratch
+  // CoreStates on worker threads that must leave Cxkk's sequence alone
+  srand(time(nullptr));
+  romHash = hashBytes(binary.data(), binary.size());
+  // nothing compiled for the previous program carries over
+  FlushCodeCache();
+  std::fill(std::begin(hotness), std::end(hotness), 0);
+  recoverCfg();
+  if (sharedRom) sharedRom = SharedCodeCache::Get().Rom(romHash, quirks);
   return true;
 }
 
+static inline u8 reverseBits(u8 byte) {
+  byte = (byte & 0xF0) >> 4 | (byte & 0x0F) << 4;
+  byte = (byte & 0xCC) >> 2 | (byte & 0x33) << 2;
+  return (byte & 0xAA) >> 1 | (byte & 0x55) << 1;
+}
+
+// Draws a row at a time: display rows hold pixel x in bit x, so a sprite
+// row is its byte bit-reversed and shifted to x. The sprite starts at x and
+// y wrapped to the screen and gets clipped at its edges. VF is set when
+// any pixel got erased.
 void CoreState::dxyn(u8 x, u8 y, u8 n) {
-  vf = 0;
-  printf("VX: %02X, VY: %02X, N: %02X\n", x, y, n);
-  for(int yy = 0; yy < n; yy++) {
-    auto pixel = ram[ip + yy];
-    for(int xx = 0; xx < 8; xx++) {
-      if((pixel & (0x80 >> xx)) != 0) {
-        if (display[yy + y] & (1ull << (xx + x))) {
-          vf = 1;
-          display[yy + y] &= ~(1ull << (xx + x));
-        } else {
-          vf = 0;
-          display[yy + y] |= (1ull << (xx + x));
-        }
-      }
-    }
+  x &= 63;
+  y &= 31;
+  u64 erased = 0;
+  for(int row = 0; row < n && y + row < 32; row++) {
+    u64 sprite = u64(reverseBits(ram[(ip + row) & 0xfff])) << x;
+    erased |= display[y + row] & sprite;
+    display[y + row] ^= sprite;
   }
-
+  vf = erased != 0;
   draw = true;
 }
 
+static inline u8 timerAt(u8 value, u64 stamp, u64 now) {
+  u64 ticks = now / kCyclesPerTick - stamp / kCyclesPerTick;
+  return ticks >= value ? 0 : value - ticks;
+}
+
+u8 CoreState::DelayAt(u64 now) const {
+  return timerAt(delay, delayStamp, now);
+}
+
+u8 CoreState::SoundAt(u64 now) const {
+  return timerAt(sound, soundStamp, now);
+}
+
 void CoreState::Fx33(u8 x) {
-  ram[ip] = vx / 100;
-  ram[ip+1] = (vx / 10) % 10;
-  ram[ip+2] = (vx % 100) % 10;
+  ram[ip & 0xfff] = vx / 100;
+  ram[(ip+1) & 0xfff] = (vx / 10) % 10;
+  ram[(ip+2) & 0xfff] = vx % 10;
+}
+
+// Register transfers wrap around the end of RAM like the other accesses
+// through I. Moving I along is up to the caller.
+void CoreState::Fx55(u8 x) {
+  for (int i = 0; i <= x; i++) ram[(ip + i) & 0xfff] = v[i];
+}
+
+void CoreState::Fx65(u8 x) {
+  for (int i = 0; i <= x; i++) v[i] = ram[(ip + i) & 0xfff];
 }
 
 void CoreState::RunInterpreter() {
@@ -85,31 +156,36 @@ void CoreState::RunInterpreter() {
         case 0x1: vx |= vy; PC += 2; break;
         case 0x2: vx &= vy; PC += 2; break;
         case 0x3: vx ^= vy; PC += 2; break;
-        case 0x4: 
-          vf = (u16(vx) + u16(vy) > 255);
+        case 0x4: {
+          u8 carry = (u16(vx) + u16(vy) > 255);
           vx += vy;
+          vf = carry;
           PC += 2;
-          break;
-        case 0x5:
-          vf = (vx > vy);
+        } break;
+        case 0x5: {
+          u8 noBorrow = (vx > vy);
           vx -= vy;
+          vf = noBorrow;
           PC += 2;
-          break;
-        case 0x6:
-          vf = vx & 1;
+        } break;
+        case 0x6: {
+          u8 lsb = vx & 1;
           vx >>= 1;
+          vf = lsb;
           PC += 2;
-          break;
-        case 0x7:
-          vf = (vx < vy);
+        } break;
+        case 0x7: {
+          u8 noBorrow = (vx < vy);
           vx = vy - vx;
+          vf = noBorrow;
           PC += 2;
-          break;
-        case 0xE:
-          vf = (vx & 0x80) != 0;
+        } break;
+        case 0xE: {
+          u8 msb = (vx & 0x80) != 0;
           vx <<= 1;
+          vf = msb;
           PC += 2;
-          break;
+        } break;
         default: unimplemented("0x8000: %02X\n", n);
       }
       break;
@@ -121,14 +197,21 @@ void CoreState::RunInterpreter() {
     case 0xE000: unimplemented("0xE000: %02X", kk);
     case 0xF000:
       switch(kk) {
-        case 0x07: vx = delay; break;
-        case 0x15: delay = vx; break;
-        case 0x18: sound = vx; break;
+        case 0x07: vx = DelayAt(cycles); break;
+        case 0x15: delay = vx; delayStamp = cycles; break;
+        case 0x18: sound = vx; soundStamp = cycles; break;
         case 0x1E: ip += vx; break;
         case 0x29: ip = 0x50 + vx * 5; break;
-        case 0x33: Fx33(x); break;
-        case 0x55: memcpy(&ram[ip], v, x+1); break;
-        case 0x65: memcpy(v, &ram[ip], x+1); break;
+        case 0x33: Fx33(x); invalidateRange(ip, 3); break;
+        case 0x55:
+          Fx55(x);
+          invalidateRange(ip, x+1);
+          if (quirks & QuirkLoadStoreIncrementsI) ip += x+1;
+          break;
+        case 0x65:
+          Fx65(x);
+          if (quirks & QuirkLoadStoreIncrementsI) ip += x+1;
+          break;
         default: unimplemented("0xF000: %02X", kk);
       }
       PC += 2;
@@ -137,14 +220,6 @@ void CoreState::RunInterpreter() {
   }
 
   cycles++;
-  if(cycles >= kTimersRate) {
-    cycles = 0;
-    delay--;
-    sound--;
-  }
-
-  if(delay <= 0) delay = 60;
-  if(sound <= 0) sound = 60;
 }
 
 static inline bool modifiesPC(u16 op) {
@@ -162,310 +237,416 @@ static inline bool modifiesPC(u16 op) {
   }
 }
 
+// Instructions that set draw hand control back to the host after them.
+static inline bool endsBlock(u16 op) {
+  return modifiesPC(op) || op == 0x00E0 || (op & 0xf000) == 0xD000;
+}
+
+// Whether op is an instruction the interpreter and the JIT implement.
+static inline bool isValidOp(u16 op) {
+  switch (op & 0xf000) {
+    case 0x0000: return op == 0x00E0 || op == 0x00EE;
+    case 0x8000: return (op & 0xf) <= 0x7 || (op & 0xf) == 0xE;
+    case 0xE000: return false;
+    case 0xF000:
+      switch (op & 0xff) {
+        case 0x07: case 0x15: case 0x18: case 0x1E:
+        case 0x29: case 0x33: case 0x55: case 0x65: return true;
+        default: return false;
+      }
+    default: return true;
+  }
+}
+
+static inline bool isSkip(u16 op) {
+  switch (op & 0xf000) {
+    case 0x3000: case 0x4000:
+    case 0x5000: case 0x9000: return true;
+    default: return false;
+  }
+}
+
+// Guest V registers an instruction reads and writes, used by the block
+// register allocator to pick host registers and entry loads.
+static inline void regUsage(u16 op, u16& read, u16& written) {
+  u8 x = (op >> 8) & 0xf;
+  u8 y = (op >> 4) & 0xf;
+  read = written = 0;
+  switch (op & 0xf000) {
+    case 0x3000: case 0x4000: read = 1 << x; break;
+    case 0x5000: case 0x9000: read = (1 << x) | (1 << y); break;
+    case 0x6000: case 0xC000: written = 1 << x; break;
+    case 0x7000: read = written = 1 << x; break;
+    case 0x8000:
+      switch (op & 0xf) {
+        case 0x0: read = 1 << y; written = 1 << x; break;
+        case 0x1: case 0x2: case 0x3: read = (1 << x) | (1 << y); written = 1 << x; break;
+        case 0x6: case 0xE: read = 1 << x; written = (1 << x) | 0x8000; break;
+        default: read = (1 << x) | (1 << y); written = (1 << x) | 0x8000; break;
+      }
+      break;
+    case 0xB000: read = 1; break;
+    case 0xD000: read = (1 << x) | (1 << y); written = 0x8000; break;
+    case 0xF000:
+      switch (op & 0xff) {
+        case 0x07: written = 1 << x; break;
+        case 0x55: read = (2 << x) - 1; break;
+        case 0x65: written = (2 << x) - 1; break;
+        default: read = 1 << x; break;
+      }
+      break;
+    default: break;
+  }
+}
+
 #define thisOffset(x) (((uintptr_t)&x) - ((uintptr_t)this))
-#undef vx
-#undef vy
-#undef vf
-#define vx (contextPtr) + thisOffset(v[x])
-#define vy (contextPtr) + thisOffset(v[y])
-#define vf (contextPtr) + thisOffset(v[0xf])
-#define IncPC do { \
-  gen->add(reg_PC, 2); \
-} while(0)
-
-void CoreState::EmitInstruction(u16 op) {
+#define hostV(i) Xbyak::Reg64(allocRegs[hostReg[i]])
+
+// Hands the most used guest registers of the block [pc, end] a host
+// register each, and loads the ones that may be read before being written.
+// An instruction that a skip can jump over doesn't define anything, and the
+// registers it writes get loaded so they hold V[i] on the skipping path too.
+void CoreState::AllocRegs(u16 pc, u16 end) {
+  int uses[16]{};
+  u16 liveIn = 0, defined = 0;
+  bool skippable = false;
+  for (;; pc += 2) {
+    u16 op = opAt(pc);
+    u16 read, written;
+    regUsage(op, read, written);
+    liveIn |= (skippable ? read | written : read) & ~defined;
+    if (!skippable) defined |= written;
+    for (int i = 0; i < 16; i++) {
+      uses[i] += ((read | written) >> i) & 1;
+    }
+    skippable = !skippable && isSkip(op) && pc < end;
+    if (pc == end) break;
+  }
+
+  memset(hostReg, -1, sizeof(hostReg));
+  memset(dirtyReg, 0, sizeof(dirtyReg));
+  for (int host = 0; host < kAllocRegs; host++) {
+    int best = -1;
+    for (int i = 0; i < 16; i++) {
+      if (uses[i] && hostReg[i] < 0 && (best < 0 || uses[i] > uses[best])) best = i;
+    }
+    if (best < 0) break;
+    hostReg[best] = host;
+  }
+
+  for (int i = 0; i < 16; i++) {
+    if (hostReg[i] >= 0 && (liveIn & (1 << i))) {
+      gen->movzx(hostV(i).cvt32(), gen->byte[contextPtr + thisOffset(v[i])]);
+    }
+  }
+}
+
+// Writes dirty host registers back to v[], so helpers and block exits see
+// the current guest state. Mappings stay valid.
+void CoreState::SpillRegs() {
+  for (int i = 0; i < 16; i++) {
+    if (hostReg[i] >= 0 && dirtyReg[i]) {
+      gen->mov(gen->byte[contextPtr + thisOffset(v[i])], hostV(i).cvt8());
+      dirtyReg[i] = false;
+    }
+  }
+}
+
+// Reloads caller-saved host registers after a helper call, plus any guest
+// registers in clobbered that the helper wrote through memory.
+void CoreState::ReloadRegs(u16 clobbered) {
+  for (int i = 0; i < 16; i++) {
+    if (hostReg[i] >= ALLOC_CALLEE_SAVED || (hostReg[i] >= 0 && (clobbered & (1 << i)))) {
+      gen->movzx(hostV(i).cvt32(), gen->byte[contextPtr + thisOffset(v[i])]);
+    }
+  }
+}
+
+// Returns the host register holding V[i], loading it into tmp if V[i]
+// was not allocated for this block.
+Xbyak::Reg8 CoreState::ReadV(u8 i, const Xbyak::Reg64& tmp) {
+  if (hostReg[i] >= 0) return hostV(i).cvt8();
+  gen->movzx(tmp.cvt32(), gen->byte[contextPtr + thisOffset(v[i])]);
+  return tmp.cvt8();
+}
+
+// Commits a value produced in r to V[i]. r is either V[i]'s own host
+// register (as returned by ReadV) or a scratch register.
+void CoreState::WriteV(u8 i, const Xbyak::Reg8& r) {
+  if (hostReg[i] >= 0) {
+    if (r.getIdx() != allocRegs[hostReg[i]]) gen->mov(hostV(i).cvt8(), r);
+    dirtyReg[i] = true;
+  } else {
+    gen->mov(gen->byte[contextPtr + thisOffset(v[i])], r);
+  }
+}
+
+void CoreState::EmitInstruction(u16 pc, u16 op) {
   u16 addr = op & 0xfff;
   u8 kk = addr & 0xff;
   u8 n = kk & 0xf;
   u8 x = (op >> 8) & 0xf;
   u8 y = (op >> 4) & 0xf;
-  gen->mov(reg_VX, gen->byte[vx]);
-  gen->mov(reg_VY, gen->byte[vy]);
 
   switch (op & 0xf000) {
   case 0x0000: {
     switch (addr) {
     case 0x0E0:
-      gen->mov(gen->byte[vx], reg_VX);
-      gen->mov(gen->byte[vy], reg_VY);
-      gen->mov(gen->byte[vf], reg_VF);
-      gen->lea(arg1, gen->qword[contextPtr + thisOffset(display)]);
-      gen->mov(arg2.cvt32(), 0);
-      gen->mov(arg3, 32*sizeof(u64));
-      gen->mov(contextPtr, (uintptr_t)memset);
-      gen->call(contextPtr);
-      gen->mov(contextPtr, (uintptr_t)this);
-      gen->mov(reg_VX, gen->byte[vx]);
-      gen->mov(reg_VY, gen->byte[vy]);
-      gen->mov(reg_VF, gen->byte[vf]);
+      // 256 bytes of zero stores, guest registers stay where they are
+      if (hostFeatures & FeatureAvx2) {
+        gen->vpxor(gen->ymm0, gen->ymm0, gen->ymm0);
+        for (int i = 0; i < 32; i += 4) gen->vmovdqa(gen->ptr[contextPtr + thisOffset(display[i])], gen->ymm0);
+        gen->vzeroupper();
+      } else {
+        gen->pxor(gen->xmm0, gen->xmm0);
+        for (int i = 0; i < 32; i += 2) gen->movdqa(gen->ptr[contextPtr + thisOffset(display[i])], gen->xmm0);
+      }
       gen->mov(gen->byte[contextPtr + thisOffset(draw)], 1);
-      IncPC;
-      break;
-    case 0x0EE:
-      gen->dec(gen->word[contextPtr + thisOffset(sp)]);
-      gen->mov(reg_PC, gen->word[contextPtr + thisOffset(stack[0]) + thisOffset(sp)]);
-      IncPC;
+      EmitEventExit(pc + 2);
       break;
+    case 0x0EE: {
+      Xbyak::Label dispatch;
+      SpillRegs();
+      gen->dec(gen->byte[contextPtr + thisOffset(sp)]);
+      gen->movzx(gen->r11d, gen->byte[contextPtr + thisOffset(sp)]);
+      gen->movzx(gen->eax, gen->word[contextPtr + gen->r11 * 2 + thisOffset(stack[0])]);
+      gen->add(gen->eax, 2);
+      gen->sub(reg_cycles, blockCount);
+      gen->jle(dispatch);
+      gen->and_(gen->r11d, 15);
+      gen->cmp(reg_PC, gen->word[contextPtr + gen->r11 * 2 + thisOffset(returnPC[0])]);
+      gen->jne(dispatch);
+      gen->jmp(gen->qword[contextPtr + gen->r11 * 8 + thisOffset(returnCode[0])]);
+      gen->L(dispatch);
+      EmitStubJmp(dispatcher);
+    } break;
     default: unimplemented("0x0000: %04X", addr);
     }
   } break;
   case 0x1000:
-    gen->mov(reg_PC, addr);
+    SpillRegs();
+    EmitLink(addr);
     break;
   case 0x2000:
-    gen->mov(gen->word[contextPtr + thisOffset(stack[0]) + thisOffset(sp)], reg_PC);
-    gen->inc(gen->word[contextPtr + thisOffset(sp)]);
-    gen->mov(reg_PC, addr);
+    SpillRegs();
+    gen->movzx(gen->r11d, gen->byte[contextPtr + thisOffset(sp)]);
+    gen->mov(gen->word[contextPtr + gen->r11 * 2 + thisOffset(stack[0])], pc);
+    gen->inc(gen->byte[contextPtr + thisOffset(sp)]);
+    // the stack itself isn't bounded, its prediction entries are
+    gen->and_(gen->r11d, 15);
+    gen->mov(gen->word[contextPtr + gen->r11 * 2 + thisOffset(returnPC[0])], pc + 2);
+    gen->mov(gen->r9, gen->qword[contextPtr + thisOffset(table[(pc + 2) & 0xfff])]);
+    gen->mov(gen->qword[contextPtr + gen->r11 * 8 + thisOffset(returnCode[0])], gen->r9);
+    EmitLink(addr);
     break;
   case 0x3000:
-    gen->mov(gen->r11, 2);
-    gen->xor_(gen->r9, gen->r9);
-    gen->cmp(reg_VX, kk);
-    gen->cmove(gen->r9, gen->r11);
-    gen->add(reg_PC, gen->r9);
-    IncPC;
-    break;
   case 0x4000:
-    gen->mov(gen->r11, 2);
-    gen->xor_(gen->r9, gen->r9);
-    gen->cmp(reg_VX, kk);
-    gen->cmovne(gen->r9, gen->r11);
-    gen->add(reg_PC, gen->r9);
-    IncPC;
-    break;
   case 0x5000:
-    gen->mov(gen->r11, 2);
-    gen->xor_(gen->r9, gen->r9);
-    gen->cmp(reg_VX, reg_VY);
-    gen->cmove(gen->r9, gen->r11);
-    gen->add(reg_PC, gen->r9);
-    IncPC;
-    break;
+  case 0x9000: {
+    // only reached for skips that end the block, see CompileBlock
+    Xbyak::Label skip;
+    SpillRegs();
+    EmitSkip(op, skip);
+    EmitLink(pc + 2);
+    gen->L(skip);
+    EmitLink(pc + 4);
+  } break;
   case 0x6000:
-    gen->mov(reg_VX, kk);
-    IncPC;
-    break;
-  case 0x7000:
-    gen->add(reg_VX, kk);
-    IncPC;
+    if (hostReg[x] >= 0) {
+      gen->mov(hostV(x).cvt32(), kk);
+      dirtyReg[x] = true;
+    } else {
+      gen->mov(gen->byte[contextPtr + thisOffset(v[x])], kk);
+    }
     break;
-  case 0x8000:
-    switch (n) {
-    case 0x0:
-      gen->mov(reg_VX, reg_VY);
-      IncPC;
-      break;
-    case 0x1:
-      gen->or_(reg_VX, reg_VY);
-      IncPC;
-      break;
-    case 0x2:
-      gen->and_(reg_VX, reg_VY);
-      IncPC;
-      break;
-    case 0x3:
-      gen->xor_(reg_VX, reg_VY);
-      IncPC;
+  case 0x7000: {
+    auto VX = ReadV(x, gen->r9);
+    gen->add(VX, kk);
+    WriteV(x, VX);
+  } break;
+  case 0x8000: {
+    auto VY = ReadV(y, gen->r11);
+    if (n == 0x0) {
+      WriteV(x, VY);
       break;
+    }
+    auto VX = ReadV(x, gen->r9);
+    // VF is written last, so it holds the flag even when x == 0xF
+    switch (n) {
+    case 0x1: gen->or_(VX, VY); WriteV(x, VX); break;
+    case 0x2: gen->and_(VX, VY); WriteV(x, VX); break;
+    case 0x3: gen->xor_(VX, VY); WriteV(x, VX); break;
     case 0x4:
-      gen->add(reg_VX, reg_VY);
-      gen->setc(reg_VF);
-      IncPC;
+      gen->add(VX, VY);
+      gen->setc(gen->al);
+      WriteV(x, VX);
+      WriteV(0xf, gen->al);
       break;
     case 0x5:
-      gen->cmp(reg_VX, reg_VY);
-      gen->setg(reg_VF);
-      gen->sub(reg_VX, reg_VY);
-      IncPC;
+      gen->cmp(VX, VY);
+      gen->seta(gen->al);
+      gen->sub(VX, VY);
+      WriteV(x, VX);
+      WriteV(0xf, gen->al);
       break;
     case 0x6:
-      gen->mov(gen->r9b, reg_VX);
-      gen->and_(gen->r9b, 1);
-      gen->setnz(reg_VF);
-      gen->sar(reg_VX, 1);
-      IncPC;
+      gen->shr(VX, 1);
+      gen->setc(gen->al);
+      WriteV(x, VX);
+      WriteV(0xf, gen->al);
       break;
     case 0x7:
-      gen->cmp(reg_VX, reg_VY);
-      gen->setg(reg_VF);
-      gen->mov(gen->r9b, reg_VY);
-      gen->sub(gen->r9b, reg_VX);
-      gen->mov(reg_VX, gen->r9b);
-      IncPC;
+      gen->cmp(VX, VY);
+      gen->setb(gen->al);
+      if (x == y) {
+        gen->xor_(VX, VX);
+      } else {
+        gen->neg(VX);
+        gen->add(VX, VY);
+      }
+      WriteV(x, VX);
+      WriteV(0xf, gen->al);
       break;
     case 0xE:
-      gen->mov(gen->r9b, reg_VX);
-      gen->and_(gen->r9b, 0x80);
-      gen->setnz(reg_VF);
-      gen->sal(reg_VX, 1);
-      IncPC;
+      gen->shl(VX, 1);
+      gen->setc(gen->al);
+      WriteV(x, VX);
+      WriteV(0xf, gen->al);
       break;
     default: unimplemented("0x8000: %02X\n", n);
     }
-    break;
-  case 0x9000:
-    gen->mov(gen->r11, 2);
-    gen->xor_(gen->r9, gen->r9);
-    gen->cmp(reg_VX, reg_VY);
-    gen->cmovne(gen->r9, gen->r11);
-    gen->add(reg_PC, gen->r9);
-    IncPC;
-    break;
+  } break;
   case 0xA000:
-    gen->mov(gen->r11w, addr);
-    gen->mov(gen->word[contextPtr + thisOffset(ip)], gen->r11w);
-    IncPC;
+    gen->mov(gen->word[contextPtr + thisOffset(ip)], addr);
     break;
   case 0xB000:
-    gen->mov(reg_PC, gen->byte[contextPtr + thisOffset(v[0])]);
+    SpillRegs();
+    gen->movzx(gen->eax, ReadV(0, gen->r9));
     gen->add(reg_PC, addr);
+    // background compiled, shared and image code is never patched
+    if (asyncCompile || sharedRom || buildingImage) EmitDispatch();
+    else EmitJumpCache();
     break;
   case 0xC000:
-    gen->mov(reg_VX, rand() & kk);
-    IncPC;
+    SpillRegs();
+    EmitCall(HelperRand);
+    ReloadRegs(0);
+    gen->and_(gen->al, kk);
+    WriteV(x, gen->al);
+    break;
+  case 0xD000:
+    SpillRegs();
+    EmitDxyn(x, y, n);
+    EmitEventExit(pc + 2);
     break;
-  case 0xD000: {
-    gen->mov(reg_VF, 0);
-    gen->mov(gen->byte[vf], reg_VF);
-    gen->mov(gen->r11b, 1);
-    gen->mov(gen->byte[contextPtr + thisOffset(draw)], gen->r11b);
-    gen->mov(gen->word[contextPtr + thisOffset(PC)], reg_PC);
-
-    gen->mov(gen->r9, 0); // yy
-    gen->L("outer");
-    {
-      gen->mov(gen->r11, 0); // xx
-      gen->mov(gen->r8, 0x80);
-      gen->L("inner");
-      {
-        gen->mov(gen->al, gen->byte[contextPtr + thisOffset(ram[0]) + gen->r9 + thisOffset(ip)]); // pixel
-        gen->sarx(gen->r8, gen->r8, gen->r11);
-        gen->test(gen->rax, gen->r8);
-        gen->jz("inner"); // skip
-
-        gen->mov(gen->r8, 1);
-        gen->mov(gen->rax, gen->r11);
-        gen->add(gen->al, reg_VX);
-        gen->shlx(gen->r8, gen->r8, gen->rax);
-        gen->test(gen->qword[contextPtr + thisOffset(display[0]) + gen->r9 + reg_VY.cvt64()], gen->rax);
-        gen->jz("isZero"); // skip
-
-        gen->mov(gen->rax, gen->qword[contextPtr + thisOffset(display[0]) + gen->r9 + reg_VY.cvt64()]);
-        gen->andn(gen->rax, gen->r8, gen->rax);
-        gen->mov(gen->qword[contextPtr + thisOffset(display[0]) + gen->r9 + reg_VY.cvt64()], gen->rax);
-        gen->mov(gen->r8, 1);
-        gen->mov(reg_VF, gen->r8);
-        gen->mov(gen->byte[vf], reg_VF);
-        gen->jmp("done");
-
-        gen->L("isZero");
-        {
-          gen->or_(gen->qword[contextPtr + thisOffset(display[0]) + gen->r9 + reg_VY.cvt64()], gen->r8);
-          gen->mov(gen->r8, 0);
-          gen->mov(reg_VF, gen->r8);
-          gen->mov(gen->byte[vf], reg_VF);
-          gen->jmp("done");
-        }
-
-        gen->L("done");
-        gen->inc(gen->r11b);
-        gen->cmp(gen->r11b, 8);
-        gen->jl("inner");
-      }
-      gen->inc(gen->r9);
-      gen->cmp(gen->r9, n);
-      gen->jl("outer");
-    }
-    gen->mov(reg_PC, gen->word[contextPtr + thisOffset(PC)]);
-    IncPC;
-  } break;
   case 0xE000: unimplemented("0xE000: %02X", kk);
   case 0xF000:
     switch (kk) {
     case 0x07:
-      gen->mov(reg_VX, delay);
+      SpillRegs();
+      EmitNow(arg2);
+      EmitCall(HelperDelayAt);
+      ReloadRegs(0);
+      WriteV(x, gen->al);
       break;
     case 0x15:
-      gen->mov(gen->byte[contextPtr + thisOffset(delay)], reg_VX);
+      EmitNow(gen->r11);
+      gen->mov(gen->qword[contextPtr + thisOffset(delayStamp)], gen->r11);
+      gen->mov(gen->byte[contextPtr + thisOffset(delay)], ReadV(x, gen->r9));
       break;
     case 0x18:
-      gen->mov(gen->byte[contextPtr + thisOffset(sound)], reg_VX);
+      EmitNow(gen->r11);
+      gen->mov(gen->qword[contextPtr + thisOffset(soundStamp)], gen->r11);
+      gen->mov(gen->byte[contextPtr + thisOffset(sound)], ReadV(x, gen->r9));
       break;
     case 0x1E:
-      gen->mov(gen->r11w, gen->word[contextPtr + thisOffset(ip)]);
-      gen->add(gen->r11b, reg_VX);
-      gen->mov(gen->word[contextPtr + thisOffset(ip)], gen->r11w);
+      gen->movzx(gen->r11d, ReadV(x, gen->r9));
+      gen->add(gen->word[contextPtr + thisOffset(ip)], gen->r11w);
       break;
     case 0x29:
-      gen->mov(gen->r11b, reg_VX);
-      gen->sal(gen->r11w, 2);
-      gen->add(gen->r11w, reg_VX);
-      gen->add(gen->r11w, 0x50);
+      gen->movzx(gen->r11d, ReadV(x, gen->r9));
+      gen->lea(gen->r11d, gen->ptr[gen->r11 + gen->r11 * 4 + 0x50]);
       gen->mov(gen->word[contextPtr + thisOffset(ip)], gen->r11w);
       break;
     case 0x33:
-      gen->mov(gen->byte[vy], reg_VY);
-      gen->mov(arg2.cvt8(), x);
-      emitMemberCall(&CoreState::Fx33, this);
-      gen->mov(reg_VY, gen->byte[vy]);
-
-      invalidate(ip);
-      invalidate(ip + 1);
-      invalidate(ip + 2);
+      // digits by reciprocal multiplication, exact for 0-255:
+      // v / 100 == v * 41 >> 12 and r / 10 == r * 205 >> 11
+      gen->movzx(gen->eax, ReadV(x, gen->rax));
+      gen->imul(gen->r9d, gen->eax, 41);
+      gen->shr(gen->r9d, 12);
+      gen->imul(gen->r11d, gen->r9d, 100);
+      gen->sub(gen->eax, gen->r11d);
+      gen->imul(gen->r11d, gen->eax, 205);
+      gen->shr(gen->r11d, 11);
+      gen->shl(gen->r11d, 8);
+      gen->or_(gen->r9d, gen->r11d);
+      gen->lea(gen->r11d, gen->ptr[gen->r11 + gen->r11 * 4]);
+      gen->shr(gen->r11d, 7);
+      gen->sub(gen->eax, gen->r11d);
+      gen->shl(gen->eax, 16);
+      gen->or_(gen->r9d, gen->eax);
+      // r9d now holds the three digits in store order, a byte each
+      gen->movzx(gen->eax, gen->word[contextPtr + thisOffset(ip)]);
+      for (int i = 0; i < 3; i++) {
+        if (i) {
+          gen->inc(gen->eax);
+          gen->shr(gen->r9d, 8);
+        }
+        gen->and_(gen->eax, 0xfff);
+        gen->mov(gen->byte[contextPtr + gen->rax + thisOffset(ram[0])], gen->r9b);
+      }
+      EmitStoreCheck(pc, 3);
       break;
     case 0x55:
-      gen->mov(gen->byte[vx], reg_VX);
-      gen->mov(gen->byte[vy], reg_VY);
-      gen->mov(gen->byte[vf], reg_VF);
-      gen->mov(arg1, thisOffset(ram[ip]));
-      gen->add(arg1, contextPtr);
-      gen->mov(arg2, thisOffset(v[0]));
-      gen->mov(arg2, contextPtr);
-      gen->mov(arg3.cvt8(), x + 1);
-      gen->mov(contextPtr, (uintptr_t)memcpy);
-      gen->call(contextPtr);
-      gen->mov(contextPtr, (uintptr_t)this);
-      gen->mov(reg_VX, gen->byte[vx]);
-      gen->mov(reg_VY, gen->byte[vy]);
-      gen->mov(reg_VF, gen->byte[vf]);
-
-      invalidate(ip);
-      break;
-    case 0x65:
-      gen->mov(gen->byte[vx], reg_VX);
-      gen->mov(gen->byte[vy], reg_VY);
-      gen->mov(gen->byte[vf], reg_VF);
-      gen->mov(arg1, thisOffset(v[0]));
-      gen->add(arg1, contextPtr);
-      gen->mov(arg2, thisOffset(ram[ip]));
-      gen->add(arg2, contextPtr);
-      gen->mov(arg3.cvt8(), x + 1);
-      gen->mov(contextPtr, (uintptr_t)memcpy);
-      gen->call(contextPtr);
-      gen->mov(contextPtr, (uintptr_t)this);
-      gen->mov(reg_VX, gen->byte[vx]);
-      gen->mov(reg_VY, gen->byte[vy]);
-      gen->mov(reg_VF, gen->byte[vf]);
-      break;
+    case 0x65: {
+      // Unrolled for the x+1 registers, straight between RAM and the host
+      // registers V is allocated to; only a transfer that wraps around the
+      // end of RAM goes through the helper.
+      Xbyak::Label slow, done;
+      bool store = kk == 0x55;
+      bool entryDirty[16], fastDirty[16];
+      memcpy(entryDirty, dirtyReg, sizeof(entryDirty));
+      gen->movzx(gen->eax, gen->word[contextPtr + thisOffset(ip)]);
+      gen->cmp(gen->eax, 0xfff - x);
+      gen->ja(slow, Xbyak::CodeGenerator::T_NEAR);
+      for (int i = 0; i <= x;) {
+        auto ramAt = contextPtr + gen->rax + thisOffset(ram[i]);
+        if (hostReg[i] >= 0 && (!store || dirtyReg[i])) {
+          if (store) gen->mov(gen->byte[ramAt], hostV(i).cvt8());
+          else gen->movzx(hostV(i).cvt32(), gen->byte[ramAt]);
+          dirtyReg[i] = dirtyReg[i] || !store;
+          i++;
+          continue;
+        }
+        // a run of registers whose v[] copy is current, moved in one go
+        int end = i;
+        while (end <= x && !(hostReg[end] >= 0 && (!store || dirtyReg[end]))) end++;
+        auto vAt = contextPtr + thisOffset(v[i]);
+        if (store) EmitCopy(ramAt, vAt, end - i);
+        else EmitCopy(vAt, ramAt, end - i);
+        i = end;
+      }
+      memcpy(fastDirty, dirtyReg, sizeof(fastDirty));
+      gen->jmp(done, Xbyak::CodeGenerator::T_NEAR);
+      gen->L(slow);
+      memcpy(dirtyReg, entryDirty, sizeof(dirtyReg));
+      SpillRegs();
+      gen->mov(arg2.cvt32(), x);
+      EmitCall(store ? HelperFx55 : HelperFx65);
+      ReloadRegs(store ? 0 : (2 << x) - 1);
+      gen->L(done);
+      // registers the fast path loaded are dirty from here on, the slow
+      // path just wrote them back already
+      memcpy(dirtyReg, fastDirty, sizeof(dirtyReg));
+      u8 advance = (quirks & QuirkLoadStoreIncrementsI) ? x + 1 : 0;
+      if (advance) gen->add(gen->word[contextPtr + thisOffset(ip)], advance);
+      if (store) EmitStoreCheck(pc, x + 1, advance);
+    } break;
     default: unimplemented("0xF000: %02X", kk);
     }
-    IncPC;
     break;
   default: unimplemented("%04X", op & 0xf000);
   }
-
-  gen->mov(gen->byte[vx], reg_VX);
-  gen->mov(gen->byte[vy], reg_VY);
-
-  cycles++;
-  if (cycles >= kTimersRate) {
-    cycles = 0;
-    delay--;
-    sound--;
-  }
-
-  if (delay <= 0) delay = 60;
-  if (sound <= 0) sound = 60;
 }
 
 static inline void Push(Xbyak::CodeGenerator& code, const std::initializer_list<Xbyak::Reg64>& regs) {
@@ -481,59 +662,1231 @@ static inline void Pop(Xbyak::CodeGenerator& code, const std::initializer_list<X
   }
 }
 
+// Jumps to skip when the skip instruction op would skip the next one.
+void CoreState::EmitSkip(u16 op, Xbyak::Label& skip) {
+  u8 kk = op & 0xff;
+  u8 x = (op >> 8) & 0xf;
+  u8 y = (op >> 4) & 0xf;
+  if ((op & 0xf000) <= 0x4000) gen->cmp(ReadV(x, gen->r9), kk);
+  else gen->cmp(ReadV(x, gen->r9), ReadV(y, gen->r11));
+  if ((op & 0xf000) == 0x3000 || (op & 0xf000) == 0x5000) gen->je(skip, Xbyak::CodeGenerator::T_NEAR);
+  else gen->jne(skip, Xbyak::CodeGenerator::T_NEAR);
+}
+
+// Last instruction of the block starting at pc. Blocks run up to the first
+// unconditional control transfer or draw; a skip only ends the block when
+// it is itself the instruction another skip jumps over. Blocks also stop
+// short of anything that isn't an instruction, as the guest may never run
+// it: the instruction behind a skip may be data, and so may whatever
+// follows a skipped jump.
+u16 CoreState::blockEnd(u16 pc) {
+  for (int count = 1;; count++, pc += 2) {
+    u16 op = opAt(pc);
+    if (isSkip(op) && pc + 2 < 0x1000) {
+      if (!isValidOp(opAt(pc + 2))) return pc;
+      pc += 2;
+      count++;
+    } else if (endsBlock(op)) {
+      return pc;
+    }
+    if (count >= BLOCK_MAX_INSTRS || pc + 2 >= 0x1000 || !isValidOp(opAt(pc + 2))) return pc;
+  }
+}
+
+// Guest instruction at addr as seen by the compiler: guest RAM, or the
+// snapshot a background compile request was made with.
+u16 CoreState::opAt(u16 addr) const {
+  return bswap_16(*reinterpret_cast<const u16*>(&compileSrc[addr - compileBase]));
+}
+
+const u8* CoreState::lookupBlock(u16 pc) const {
+  auto func = table[pc & 0xfff].load(std::memory_order_relaxed);
+  return func != compileStub ? func : nullptr;
+}
+
+static inline void patchJmp(u8* jmp, const u8* dest) {
+  s32 rel = s32(dest - (jmp + 5));
+  memcpy(jmp + 1, &rel, sizeof(rel));
+}
+
+// Leaves the block towards a static target. While the target is not compiled
+// (or once it gets invalidated) the jmp falls through to a stub that hands
+// the target to the dispatcher; linking patches it to jump into the target block.
+// Once the budget is used up the stub is taken regardless and the dispatcher
+// leaves JIT code.
+void CoreState::EmitLink(u16 target) {
+  Xbyak::Label unlinked;
+  gen->sub(reg_cycles, blockCount);
+  gen->jle(unlinked, Xbyak::CodeGenerator::T_NEAR);
+  auto jmp = const_cast<u8*>(gen->getCurr());
+  gen->jmp(unlinked, Xbyak::CodeGenerator::T_NEAR);
+  gen->L(unlinked);
+  // background compiled and shared code is never patched while it may be running
+  if (!asyncCompile && !sharedRom) addLink({jmp, gen->getCurr(), blockStart, u16(target & 0xfff)});
+  gen->mov(reg_PC, target);
+  EmitStubJmp(dispatcher);
+}
+
+// Layout of a way of a Bnnn jump cache: cmp eax, imm32 holding the target
+// it caches; jne rel8 to the next way; jmp rel32 linked to the target block
+// like an EmitLink exit. The ways are followed by the jmp rel32 to the miss
+// handler.
+constexpr int kJumpCacheWaySize = 12;
+constexpr int kJumpCacheJmp = 7;
+// Target of an empty way, further than any Bnnn jumps
+constexpr u32 kJumpCacheEmpty = 0xffff;
+
+// Ends the block with a Bnnn through a small inline cache of the targets
+// the site has taken, so jump tables run as direct jumps between blocks.
+// Empty ways get filled on a miss by jumpCacheMiss.
+void CoreState::EmitJumpCache() {
+  Xbyak::Label site, miss, dispatch;
+  gen->sub(reg_cycles, blockCount);
+  gen->jle(dispatch, Xbyak::CodeGenerator::T_NEAR);
+  gen->L(site);
+  auto siteStart = gen->getCurr();
+  for (int way = 0; way < kJumpCacheWays; way++) {
+    Xbyak::Label next;
+    auto wayStart = gen->getCurr();
+    // cmp eax, imm32 spelled out, xbyak would pick the imm8 form for some
+    // targets and jumpCacheMiss patches the imm32 in place
+    gen->db(0x3D);
+    gen->dd(kJumpCacheEmpty);
+    gen->jne(next, Xbyak::CodeGenerator::T_SHORT);
+    gen->jmp(dispatch, Xbyak::CodeGenerator::T_NEAR);
+    gen->L(next);
+    if (gen->getCurr() - wayStart != kJumpCacheWaySize) throw Xbyak::Error(Xbyak::ERR_INTERNAL);
+  }
+  if (gen->getCurr() != siteStart + kJumpCacheWays * kJumpCacheWaySize) throw Xbyak::Error(Xbyak::ERR_INTERNAL);
+  gen->jmp(miss, Xbyak::CodeGenerator::T_NEAR);
+  gen->L(miss);
+  gen->mov(gen->word[contextPtr + thisOffset(PC)], reg_PC);
+  gen->lea(arg2, gen->ptr[gen->rip + site]);
+  gen->mov(arg3.cvt32(), blockStart);
+  gen->movzx(arg4.cvt32(), reg_PC);
+  EmitCall(HelperJumpCacheMiss);
+  gen->movzx(gen->eax, gen->word[contextPtr + thisOffset(PC)]);
+  gen->L(dispatch);
+  EmitStubJmp(dispatcher);
+}
+
+// Caches target in the next empty way of the Bnnn site and links it.
+// Taking the last way makes the site megamorphic: its misses go straight
+// to the dispatcher from then on.
+void CoreState::jumpCacheMiss(u8* site, u16 owner, u16 target) {
+  std::lock_guard<std::mutex> lock(jitMutex);
+  for (int way = 0; way < kJumpCacheWays; way++) {
+    u8* cmp = site + way * kJumpCacheWaySize;
+    u32 cached;
+    memcpy(&cached, cmp + 1, sizeof(cached));
+    if (cached != kJumpCacheEmpty) continue;
+    // an empty way still jumps to the dispatch stub the site ends with
+    u8* jmp = cmp + kJumpCacheJmp;
+    s32 rel;
+    memcpy(&rel, jmp + 1, sizeof(rel));
+    const u8* unlinked = jmp + 5 + rel;
+    cached = target;
+    memcpy(cmp + 1, &cached, sizeof(cached));
+    addLink({jmp, unlinked, owner, u16(target & 0xfff)});
+    if (auto func = lookupBlock(target)) patchJmp(jmp, func);
+    if (way == kJumpCacheWays - 1) patchJmp(site + kJumpCacheWays * kJumpCacheWaySize, unlinked);
+    return;
+  }
+}
+
+// Computes the cycle count the instruction being emitted runs at, the same
+// value cycles has while the interpreter executes it.
+void CoreState::EmitNow(const Xbyak::Reg64& reg) {
+  gen->movsxd(reg, reg_cycles);
+  gen->neg(reg);
+  gen->add(reg, gen->qword[contextPtr + thisOffset(cycleBase)]);
+  gen->add(reg, blockCount - 1);
+}
+
+// Cycles a delay timer polling loop of the given period, entered at now,
+// can skip without changing anything: all the iterations that still read a
+// nonzero delay, except for the last one the budget allows so the loop
+// leaves JIT code exactly as if it had run.
+u32 CoreState::delayWaitSkip(u64 now, s32 left, u32 period) {
+  u64 zeroAt = (delayStamp / kCyclesPerTick + delay) * kCyclesPerTick;
+  if (now >= zeroAt) return 0;
+  u64 iterations = std::min<u64>((zeroAt - now + period - 1) / period, u64(left - 1) / period);
+  return u32(iterations * period);
+}
+
+// Blocks that only wait for time to pass fast-forward the emulated clock
+// instead of spinning through the budget: a jump to itself, and the
+// Fx07; 3x00; 1nnn loop waiting for the delay timer to reach zero.
+void CoreState::EmitIdleSkip(u16 pc) {
+  u16 op = opAt(pc);
+  if (op == (0x1000 | pc)) {
+    // nothing can ever leave this loop, burn whatever is left of the budget
+    gen->mov(reg_cycles, 1);
+    return;
+  }
+  if (pc + 4 >= 0x1000) return;
+  u8 x = (op >> 8) & 0xf;
+  if ((op & 0xf0ff) != 0xF007 || opAt(pc + 2) != (0x3000 | x << 8) || opAt(pc + 4) != (0x1000 | pc)) return;
+
+  blockCount = 1;
+  EmitNow(arg2);
+  gen->mov(arg3.cvt32(), reg_cycles);
+  gen->mov(arg4.cvt32(), 3);
+  EmitCall(HelperDelayWaitSkip);
+  gen->sub(reg_cycles, gen->eax);
+}
+
+// Checks the len bytes a store just wrote at ip - advance against codeMap,
+// and leaves the block through smcExit when they hit compiled code, as the
+// rest of the block may be stale. Only the scratch registers get clobbered
+// on the way through; guest registers are spilled on the way out.
+void CoreState::EmitStoreCheck(u16 pc, u8 len, u8 advance) {
+  Xbyak::Label clean;
+  // orders the store before the codeMap load, see installBlock
+  if (asyncCompile) gen->mfence();
+  // the shift count goes in cl, and rcx may hold a guest register
+  gen->mov(gen->r9, gen->rcx);
+  gen->movzx(gen->ecx, gen->word[contextPtr + thisOffset(ip)]);
+  if (advance) gen->sub(gen->ecx, advance);
+  gen->and_(gen->ecx, 0xfff);
+  gen->mov(gen->r11d, gen->ecx);
+  gen->shr(gen->r11d, 3);
+  gen->mov(gen->r11d, gen->dword[contextPtr + gen->r11 + thisOffset(codeMap[0])]);
+  gen->and_(gen->ecx, 7);
+  gen->shr(gen->r11d, gen->cl);
+  gen->mov(gen->rcx, gen->r9);
+  gen->test(gen->r11d, (1 << len) - 1);
+  gen->jz(clean, Xbyak::CodeGenerator::T_NEAR);
+  bool dirty[16];
+  memcpy(dirty, dirtyReg, sizeof(dirty));
+  SpillRegs();
+  memcpy(dirtyReg, dirty, sizeof(dirty));
+  gen->movzx(arg2.cvt32(), gen->word[contextPtr + thisOffset(ip)]);
+  if (advance) gen->sub(arg2.cvt32(), advance);
+  gen->and_(arg2.cvt32(), 0xfff);
+  gen->mov(arg3.cvt32(), len);
+  gen->sub(reg_cycles, blockCount);
+  gen->mov(reg_PC, pc + 2);
+  EmitStubJmp(smcExit);
+  gen->L(clean);
+}
+
+// Copies len bytes from src to dst with the widest moves that fit,
+// through the scratch registers.
+void CoreState::EmitCopy(const Xbyak::RegExp& dst, const Xbyak::RegExp& src, u8 len) {
+  for (u8 done = 0; done < len;) {
+    u8 left = len - done;
+    if (left >= 16) {
+      gen->movdqu(gen->xmm0, gen->ptr[src + done]);
+      gen->movdqu(gen->ptr[dst + done], gen->xmm0);
+      done += 16;
+      continue;
+    }
+    u8 size = left >= 8 ? 8 : left >= 4 ? 4 : left >= 2 ? 2 : 1;
+    auto tmp = gen->r9.changeBit(size * 8);
+    gen->mov(tmp, gen->ptr[src + done]);
+    gen->mov(gen->ptr[dst + done], tmp);
+    done += size;
+  }
+}
+
+// Calls a helper through the context's helper table, so the code works for
+// any CoreState, and gets contextPtr back from its stack slot afterwards.
+void CoreState::EmitCall(Helper helper) {
+  if (helper >= HelperDxyn) gen->mov(arg1, contextPtr);
+  gen->call(gen->qword[contextPtr + thisOffset(helpers[helper])]);
+  gen->mov(contextPtr, contextSlot);
+}
+
+const u8* CoreState::stubAddress(u8 index) const {
+  const u8* stubs[] = {dispatcher, dispatchExit, smcExit};
+  return index < 3 ? stubs[index] : nullptr;
+}
+
+// Jumps to a stub with a rel32 that gets relocated with the block.
+void CoreState::EmitStubJmp(const u8* stub) {
+  gen->jmp(stub, Xbyak::CodeGenerator::T_NEAR);
+  u8 index = 0;
+  while (stubAddress(index) && stubAddress(index) != stub) index++;
+  relocs.push_back({u32(gen->getSize() - 4 - blockMark), index});
+}
+
+// Dxyn the way dxyn does it, with every row in one pass on AVX2 hosts: the
+// sprite bytes get bit-reversed with a nibble lookup, widened to a row per
+// qword lane and shifted to x, then XORed into the display four rows at a
+// time. Masked loads and stores clip the rows past n or the bottom of the
+// screen, and VF ORs together whether any lane erased a pixel. Only ymm0-5
+// get used, which are caller-saved on Windows too. A sprite wrapping
+// around the end of RAM goes through dxyn instead.
+void CoreState::EmitDxyn(u8 x, u8 y, u8 n) {
+  Xbyak::Label slow, done;
+  if (hostFeatures & FeatureAvx2) {
+    auto xmm = [](int idx) { return Xbyak::Xmm(idx); };
+    auto ymm = [](int idx) { return Xbyak::Ymm(idx); };
+    gen->movzx(gen->eax, gen->word[contextPtr + thisOffset(ip)]);
+    gen->cmp(gen->eax, 0x1000 - n);
+    gen->ja(slow, Xbyak::CodeGenerator::T_NEAR);
+    gen->vmovdqu(xmm(0), gen->ptr[contextPtr + gen->rax + thisOffset(ram[0])]);
+    gen->movzx(gen->r9d, gen->byte[contextPtr + thisOffset(v[x])]);
+    gen->and_(gen->r9d, 63);
+    gen->vmovd(xmm(4), gen->r9d);
+
+    // rows that get drawn: min(n, 32 - y), as a byte mask in xmm5
+    gen->movzx(gen->r11d, gen->byte[contextPtr + thisOffset(v[y])]);
+    gen->and_(gen->r11d, 31);
+    gen->mov(gen->r9d, 32);
+    gen->sub(gen->r9d, gen->r11d);
+    gen->mov(gen->eax, n);
+    gen->cmp(gen->r9d, gen->eax);
+    gen->cmova(gen->r9d, gen->eax);
+    gen->neg(gen->r9);
+    gen->vmovdqu(xmm(5), gen->ptr[contextPtr + gen->r9 + thisOffset(rowMask[16])]);
+
+    gen->vpand(xmm(1), xmm(0), gen->ptr[contextPtr + thisOffset(nibbleMask)]);
+    gen->vpsrlw(xmm(2), xmm(0), 4);
+    gen->vpand(xmm(2), xmm(2), gen->ptr[contextPtr + thisOffset(nibbleMask)]);
+    gen->vmovdqu(xmm(3), gen->ptr[contextPtr + thisOffset(nibbleReverse)]);
+    gen->vpshufb(xmm(1), xmm(3), xmm(1));
+    gen->vpsllw(xmm(1), xmm(1), 4);
+    gen->vpshufb(xmm(2), xmm(3), xmm(2));
+    gen->vpor(xmm(0), xmm(1), xmm(2));
+
+    gen->lea(gen->rax, gen->ptr[contextPtr + gen->r11 * 8 + thisOffset(display[0])]);
+    gen->xor_(gen->r9d, gen->r9d);
+    for (int row = 0; row < n; row += 4) {
+      if (row) {
+        gen->vpsrldq(xmm(0), xmm(0), 4);
+        gen->vpsrldq(xmm(5), xmm(5), 4);
+      }
+      gen->vpmovzxbq(ymm(1), xmm(0));
+      gen->vpsllq(ymm(1), ymm(1), xmm(4));
+      gen->vpmovsxbq(ymm(2), xmm(5));
+      gen->vpmaskmovq(ymm(3), ymm(2), gen->ptr[gen->rax + row * 8]);
+      gen->vptest(ymm(3), ymm(1));
+      gen->setnz(gen->r11b);
+      gen->or_(gen->r9b, gen->r11b);
+      gen->vpxor(ymm(3), ymm(3), ymm(1));
+      gen->vpmaskmovq(gen->ptr[gen->rax + row * 8], ymm(2), ymm(3));
+    }
+    gen->vzeroupper();
+    gen->mov(gen->byte[contextPtr + thisOffset(v[0xf])], gen->r9b);
+    gen->mov(gen->byte[contextPtr + thisOffset(draw)], 1);
+    gen->jmp(done, Xbyak::CodeGenerator::T_NEAR);
+  }
+
+  gen->L(slow);
+  gen->movzx(arg2.cvt32(), gen->byte[contextPtr + thisOffset(v[x])]);
+  gen->movzx(arg3.cvt32(), gen->byte[contextPtr + thisOffset(v[y])]);
+  gen->mov(arg4.cvt32(), n);
+  EmitCall(HelperDxyn);
+  gen->L(done);
+}
+
+// Leaves the block towards the PC in reg_PC.
+void CoreState::EmitDispatch() {
+  gen->sub(reg_cycles, blockCount);
+  EmitStubJmp(dispatcher);
+}
+
+// Leaves JIT code after an instruction the host has to see, like a draw.
+void CoreState::EmitEventExit(u16 target) {
+  SpillRegs();
+  gen->sub(reg_cycles, blockCount);
+  gen->mov(reg_PC, target);
+  EmitStubJmp(dispatchExit);
+}
+
+// Registers an exit under the block it leaves and the block it enters.
+void CoreState::addLink(const LinkSite& site) {
+  linksFrom[site.owner].push_back(site);
+  linksTo[site.target].push_back(site);
+}
+
+// Forgets an exit as one of the jumps into its target.
+void CoreState::dropLink(const LinkSite& site) {
+  auto& into = linksTo[site.target];
+  into.erase(std::find_if(into.begin(), into.end(), [&](const LinkSite& other) { return other.jmp == site.jmp; }));
+}
+
+// Points every jump into the block starting at start back to its unlinked
+// stub, and forgets the exits owned by that block.
+void CoreState::unlinkBlock(u16 start) {
+  for (auto& site : linksTo[start]) patchJmp(site.jmp, site.unlinked);
+  for (auto& site : linksFrom[start]) dropLink(site);
+  linksFrom[start].clear();
+}
+
+// Kills every compiled block covering the byte at addr.
 void CoreState::invalidate(u16 addr) {
-  auto [cks, start_addr, end_addr, func] = cache[addr & BLOCKS_DSIZE];
-  // we do not care about non-program stuff
-  if(addr < 0x200) return;
-
-  // early exit if it's not compiled in the first place
-  if(!func) return;
-
-  for (int i = 0; i < BLOCKS_SIZE; i++) {
-    if (addr >= cache[i].start_addr && addr <= cache[i].end_addr) {
-      cache[i].func = nullptr;
-      cache[i].start_addr = -1;
-      cache[i].end_addr = -1;
-      break;
+  // evictBlock edits the list we walk
+  auto starts = blocksAt[addr & 0xfff];
+  if (!starts.empty()) forgetReturns();
+  for (u16 start : starts) {
+    auto func = lookupBlock(start);
+    // already gone with the image
+    if (!func) continue;
+    if (inImage(func)) {
+      dropImage();
+    } else {
+      evictBlock(start);
     }
+    // code that gets rewritten has to earn its compile again
+    hotness[start] = 0;
   }
 }
 
-void CoreState::RunJit() {
-  u16 pc = PC;
-  
-  if (cache[(PC - 0x200) & BLOCKS_DSIZE].func) {
-    cache[(PC - 0x200) & BLOCKS_DSIZE].func();
-  } else {
-    cache[(PC - 0x200) & BLOCKS_DSIZE].start_addr = pc;
-    cache[(PC - 0x200) & BLOCKS_DSIZE].func = gen->getCurr<void(*)()>();
+void CoreState::invalidateRange(u16 addr, u16 len) {
+  std::lock_guard<std::mutex> lock(jitMutex);
+  for (u16 i = 0; i < len; i++) {
+    if (codeMap[((addr + i) & 0xfff) >> 3] & (1 << ((addr + i) & 7))) invalidate(addr + i);
+  }
+}
 
-    Push(*gen, {gen->rbx, gen->rbp, gen->r12, gen->r13, gen->r14, gen->r15});
+// Return predictions may point into blocks about to go away. Runs on the
+// thread running JIT code, never on the compile worker.
+void CoreState::forgetReturns() {
+  std::fill(std::begin(returnCode), std::end(returnCode), dispatcher);
+}
+
+// Unlinks a compiled block and drops it from the table and the reverse map.
+void CoreState::evictBlock(u16 start) {
+  auto& block = blocks[start];
+  unlinkBlock(start);
+  for (u32 addr = start; addr <= block.end_addr + 1 && addr < 0x1000; addr++) {
+    auto& starts = blocksAt[addr];
+    starts.erase(std::find(starts.begin(), starts.end(), start));
+    if (starts.empty()) codeMap[addr >> 3] &= ~(1 << (addr & 7));
+  }
+  block = {};
+  table[start].store(compileStub, std::memory_order_relaxed);
+}
+
+// Emits the shared entry trampoline, exit and dispatcher stub. jitEntry
+// saves the callee-saved host registers once per RunJit and enters the
+// dispatcher, which jumps through the block table entry of the guest PC.
+// Entries of blocks that aren't compiled point to compileStub. JIT code is
+// only left through dispatchExit once the budget in reg_cycles is used up,
+// or on a draw.
+void CoreState::EmitDispatcher() {
+  dispatchExit = gen->getCurr();
+  gen->mov(gen->word[contextPtr + thisOffset(PC)], reg_PC);
+  gen->mov(gen->dword[contextPtr + thisOffset(budget)], reg_cycles);
 #ifdef _WIN32
-    Push(*gen, {gen->rsi, gen->rdi});
+  gen->add(gen->rsp, 40);
+  Pop(*gen, {gen->rsi, gen->rdi});
+#else
+  gen->add(gen->rsp, 8);
 #endif
-    gen->mov(gen->rbp, gen->rsp);
-    gen->mov(contextPtr, (uintptr_t)this);
-    gen->mov(reg_PC, gen->word[contextPtr + thisOffset(PC)]);
-    gen->mov(reg_VF, gen->word[contextPtr + thisOffset(v[0xf])]);
-
-    u16 op = bswap_16(*reinterpret_cast<u16*>(&ram[pc]));
-    EmitInstruction(op);
-    while (!modifiesPC(op)) {
+  Pop(*gen, {gen->rbx, gen->rbp, gen->r12, gen->r13, gen->r14, gen->r15});
+  gen->ret();
+
+  // a store hit compiled code: arg2 and arg3 hold the range it wrote
+  smcExit = gen->getCurr();
+  gen->mov(gen->word[contextPtr + thisOffset(PC)], reg_PC);
+  EmitCall(HelperInvalidateRange);
+  gen->mov(reg_PC, gen->word[contextPtr + thisOffset(PC)]);
+
+  dispatcher = gen->getCurr();
+  gen->test(reg_cycles, reg_cycles);
+  gen->jle(dispatchExit);
+  gen->and_(gen->eax, 0xfff);
+  gen->jmp(gen->qword[contextPtr + gen->rax * 8 + thisOffset(table[0])]);
+
+  // a block that isn't compiled yet: compile it, or leave JIT code so
+  // RunFor interprets it while it is still cold
+  Xbyak::Label cold;
+  compileStub = gen->getCurr();
+  gen->mov(gen->word[contextPtr + thisOffset(PC)], reg_PC);
+  gen->mov(arg2.cvt32(), gen->eax);
+  EmitCall(HelperBlockMiss);
+  gen->test(gen->rax, gen->rax);
+  gen->jz(cold);
+  gen->jmp(gen->rax);
+  gen->L(cold);
+  gen->mov(reg_PC, gen->word[contextPtr + thisOffset(PC)]);
+  gen->jmp(dispatchExit);
+
+  jitEntry = gen->getCurr<void(*)(CoreState*)>();
+  Push(*gen, {gen->rbx, gen->rbp, gen->r12, gen->r13, gen->r14, gen->r15});
+#ifdef _WIN32
+  Push(*gen, {gen->rsi, gen->rdi});
+  gen->sub(gen->rsp, 40); // keep rsp 16-byte aligned and reserve shadow space for helper calls
+#else
+  gen->sub(gen->rsp, 8); // keep rsp 16-byte aligned for helper calls
+#endif
+  gen->mov(contextPtr, arg1);
+  gen->mov(contextSlot, contextPtr);
+  gen->mov(reg_PC, gen->word[contextPtr + thisOffset(PC)]);
+  gen->mov(reg_cycles, gen->dword[contextPtr + thisOffset(budget)]);
+  gen->jmp(dispatcher);
+}
+
+void CoreState::useStubs(const JitStubs& stubs) {
+  jitEntry = stubs.entry;
+  dispatcher = stubs.dispatcher;
+  dispatchExit = stubs.dispatchExit;
+  smcExit = stubs.smcExit;
+  compileStub = stubs.compileStub;
+}
+
+// Compiles the block starting at pc and returns its code. When the code
+// cache fills up, everything compiled so far is flushed and the block gets
+// compiled again into the empty cache. This is only safe because
+// CompileBlock runs from compileStub, with no block code on the stack.
+const u8* CoreState::CompileBlock(u16 pc) {
+  compileSrc = ram;
+  compileBase = 0;
+  if (sharedRom) {
+    if (auto func = compileShared(pc)) return func;
+  }
+  u16 last;
+  const u8* func;
+  try {
+    func = emitBlock(pc, last);
+  } catch (Xbyak::Error& e) {
+    if (e != Xbyak::ERR_CODE_IS_TOO_BIG) throw;
+    FlushCodeCache();
+    func = emitBlock(pc, last);
+  }
+  compiles++;
+  if (!installBlock(pc, last, func, u32(gen->getCurr() - func))) {
+    gen->setSize(func - gen->getCode());
+    return lookupBlock(pc);
+  }
+  return func;
+}
+
+// Drops every compiled block and reclaims their code, keeping the stubs
+// emitted by the constructor.
+void CoreState::FlushCodeCache() {
+  std::lock_guard<std::mutex> lock(jitMutex);
+  gen->setSize(stubsSize);
+  for (auto& entry : table) entry.store(compileStub, std::memory_order_relaxed);
+  forgetReturns();
+  std::fill(std::begin(blocks), std::end(blocks), BasicBlock{});
+  for (auto& starts : blocksAt) starts.clear();
+  memset(codeMap, 0, sizeof(codeMap));
+  for (auto& sites : linksFrom) sites.clear();
+  for (auto& sites : linksTo) sites.clear();
+  flushPending = false;
+  flushes++;
+  if (aotCode) {
+    aotCode = nullptr;
+    gen->setProtectMode(Xbyak::CodeGenerator::PROTECT_RWE);
+  }
+}
+
+void CoreState::SetQuirks(u32 selected) {
+  if (selected == quirks) return;
+  {
+    std::lock_guard<std::mutex> lock(jitMutex);
+    quirks = selected;
+  }
+  FlushCodeCache();
+  if (sharedRom) sharedRom = SharedCodeCache::Get().Rom(romHash, quirks);
+}
+
+CodeCacheStats CoreState::CacheStats() const {
+  std::lock_guard<std::mutex> lock(jitMutex);
+  CodeCacheStats stats{};
+  stats.capacity = codeCapacity;
+  stats.used = gen->getSize();
+  stats.blocks = u32(std::count_if(std::begin(table), std::end(table), [this](const auto& entry) { return entry.load() != compileStub; }));
+  stats.compiles = compiles;
+  stats.flushes = flushes;
+  return stats;
+}
+
+// Emits the block starting at pc, and returns its code and the address of
+// its last instruction.
+const u8* CoreState::emitBlock(u16 pc, u16& last) {
+  blockStart = pc;
+  blockMark = gen->getSize();
+  relocs.clear();
+  auto func = gen->getCurr();
+  u16 end = blockEnd(pc);
+  EmitIdleSkip(pc);
+  AllocRegs(pc, end);
+
+  // Skips become in-block branches around the instruction they skip, so
+  // the block keeps going on both paths. Registers stay allocated across
+  // the branch; a register is dirty after the join if it is on either path.
+  // The skipped instruction is emitted with its own cycle counted, and
+  // charges it by itself when it doesn't leave the block, so both paths
+  // agree on blockCount after the join.
+  bool fallsThrough = true;
+  blockCount = 0;
+  for (;; pc += 2) {
+    u16 op = opAt(pc);
+    blockCount++;
+    if (isSkip(op) && pc < end) {
+      Xbyak::Label skip;
+      bool dirty[16];
+      memcpy(dirty, dirtyReg, sizeof(dirty));
+      EmitSkip(op, skip);
       pc += 2;
-      op = bswap_16(*reinterpret_cast<u16*>(&ram[pc]));
-      EmitInstruction(op);
+      op = opAt(pc);
+      blockCount++;
+      EmitInstruction(pc, op);
+      blockCount--;
+      if (!endsBlock(op)) gen->dec(reg_cycles);
+      for (int i = 0; i < 16; i++) {
+        dirtyReg[i] = endsBlock(op) ? dirty[i] : dirtyReg[i] || dirty[i];
+      }
+      gen->L(skip);
+    } else {
+      EmitInstruction(pc, op);
+      fallsThrough = !endsBlock(op);
+    }
+    if (pc == end) break;
+  }
+  if (fallsThrough) {
+    SpillRegs();
+    EmitLink(end + 2);
+  }
+  last = end;
+  return func;
+}
+
+// Registers the block [start, last] emitted at func and publishes it in the
+// block table. A block compiled in the background was read from a snapshot
+// of guest RAM, so it only goes live if RAM still matches the snapshot once
+// codeMap covers it. Stores fence between writing RAM and checking codeMap,
+// so either the store sees the new bits and invalidates the block, or the
+// snapshot check here sees the store. A start that is compiled already is
+// refused, along with the exits the new copy registered: installing it
+// twice would leave the first copy's exits and blocksAt entries behind.
+bool CoreState::installBlock(u16 start, u16 last, const u8* func, u32 size) {
+  if (lookupBlock(start)) {
+    auto& from = linksFrom[start];
+    auto copy = std::partition(from.begin(), from.end(), [&](const LinkSite& site) {
+      return site.jmp < func || site.jmp >= func + size;
+    });
+    std::for_each(copy, from.end(), [this](const LinkSite& site) { dropLink(site); });
+    from.erase(copy, from.end());
+    return false;
+  }
+  auto& block = blocks[start];
+  size_t len = std::min<size_t>(last + 2u, 0x1000) - start;
+  block.end_addr = last;
+  block.cks = u32(hashBytes(&compileSrc[start - compileBase], len));
+  block.size = size;
+  block.relocs = std::move(relocs);
+  for (u32 addr = start; addr <= last + 1u && addr < 0x1000; addr++) {
+    blocksAt[addr].push_back(start);
+    codeMap[addr >> 3] |= 1 << (addr & 7);
+  }
+  if (asyncCompile) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (memcmp(&ram[start], compileSrc, len) != 0) {
+      evictBlock(start);
+      return false;
     }
+  }
+  table[start].store(func, std::memory_order_release);
+
+  // link the waiting exits to this block and the new exits to compiled targets
+  for (auto& site : linksTo[start]) patchJmp(site.jmp, func);
+  for (auto& site : linksFrom[start]) {
+    if (auto target = lookupBlock(site.target)) patchJmp(site.jmp, target);
+  }
+  return true;
+}
+
+// Layout of a persisted code cache file: a header, then for every block a
+// CachedBlock followed by its code, relocations and link sites.
+struct CacheHeader {
+  char magic[4];
+  u32 version, features, quirks, contextSize, count;
+  u64 romHash;
+};
+
+struct CachedBlock {
+  u16 start, last;
+  u32 cks, size, relocs, sites;
+};
 
-    gen->mov(gen->word[contextPtr + thisOffset(PC)], reg_PC);
-    gen->mov(gen->word[contextPtr + thisOffset(v[0xf])], reg_VF);
+static inline fs::path cacheFile(const fs::path& dir, u64 romHash) {
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.jit", (unsigned long long)romHash);
+  return dir / name;
+}
 
+// Whether path is a directory or file of ours nobody else can write to.
+// Cache files hold code that gets run, so they must not come from a place
+// other users can plant them in. On Windows only the type gets checked: the
+// owner and ACL aren't, so this relies on %LOCALAPPDATA% being private.
+static bool ownedPrivately(const fs::path& path, bool directory) {
 #ifdef _WIN32
-    Pop(*gen, {gen->rsi, gen->rdi});
+  std::error_code error;
+  return directory ? fs::is_directory(path, error) : fs::is_regular_file(path, error);
+#else
+  struct stat info;
+  if (lstat(path.c_str(), &info) != 0 || info.st_uid != geteuid() || (info.st_mode & (S_IWGRP | S_IWOTH))) return false;
+  return directory ? S_ISDIR(info.st_mode) : S_ISREG(info.st_mode);
 #endif
-    Pop(*gen, {gen->rbx, gen->rbp, gen->r12, gen->r13, gen->r14, gen->r15});
-    gen->ret();
-    cache[(PC - 0x200) & BLOCKS_DSIZE].end_addr = pc;
-    cache[(PC - 0x200) & BLOCKS_DSIZE].func();
+}
+
+// Whether everything a block read from a cache file points at lies within
+// its code, so importBlock never writes outside of it.
+static bool validBlock(const PortableBlock& block) {
+  size_t size = block.code.size();
+  for (auto& reloc : block.relocs) {
+    if (reloc.offset + 4ull > size || reloc.stub >= 3) return false;
+  }
+  for (auto& site : block.sites) {
+    if (site.jmp + 5ull > size || site.unlinked >= size) return false;
+  }
+  return true;
+}
+
+fs::path CoreState::CodeCacheDir() {
+  fs::path base;
+#ifdef _WIN32
+  if (auto local = getenv("LOCALAPPDATA"); local && *local) base = local;
+#else
+  if (auto xdg = getenv("XDG_CACHE_HOME"); xdg && *xdg) base = xdg;
+  else if (auto home = getenv("HOME"); home && *home) base = fs::path(home) / ".cache";
+#endif
+  if (base.empty()) return {};
+  std::error_code error;
+  fs::create_directories(base, error);
+  fs::path dir = base / "jit8";
+#ifdef _WIN32
+  fs::create_directory(dir, error);
+#else
+  mkdir(dir.c_str(), 0700);
+#endif
+  return ownedPrivately(dir, true) ? dir : fs::path{};
+}
+
+bool CoreState::SaveCodeCache(const fs::path& dir) const {
+  std::lock_guard<std::mutex> lock(jitMutex);
+  std::error_code error;
+  fs::create_directories(dir, error);
+  if (!ownedPrivately(dir, true)) return false;
+  std::ofstream file(cacheFile(dir, romHash), std::ios::binary);
+  if (!file) return false;
+  fs::permissions(cacheFile(dir, romHash), fs::perms::owner_read | fs::perms::owner_write, error);
+  auto put = [&file](const void* data, size_t len) { file.write(reinterpret_cast<const char*>(data), len); };
+
+  std::vector<u16> starts;
+  for (u16 start = 0; start < 0x1000; start++) {
+    if (lookupBlock(start) && !inImage(lookupBlock(start))) starts.push_back(start);
+  }
+  CacheHeader header{{'J', '8', 'J', 'C'}, kJitVersion, hostFeatures, quirks, u32(sizeof(CoreState)), u32(starts.size()), romHash};
+  put(&header, sizeof(header));
+
+  for (u16 start : starts) {
+    auto block = exportBlock(start);
+    CachedBlock cached{start, block.last, block.cks, u32(block.code.size()), u32(block.relocs.size()), u32(block.sites.size())};
+    put(&cached, sizeof(cached));
+    put(block.code.data(), block.code.size());
+    put(block.relocs.data(), block.relocs.size() * sizeof(Reloc));
+    put(block.sites.data(), block.sites.size() * sizeof(PortableSite));
+  }
+  return bool(file);
+}
+
+bool CoreState::LoadCodeCache(const fs::path& dir) {
+  if (asyncCompile || sharedRom) return false;
+  if (!ownedPrivately(dir, true) || !ownedPrivately(cacheFile(dir, romHash), false)) return false;
+  std::ifstream file(cacheFile(dir, romHash), std::ios::binary);
+  auto get = [&file](void* data, size_t len) { return bool(file.read(reinterpret_cast<char*>(data), len)); };
+
+  CacheHeader header;
+  if (!get(&header, sizeof(header)) || memcmp(header.magic, "J8JC", 4) != 0 ||
+      header.version != kJitVersion || header.features != hostFeatures || header.quirks != quirks || header.contextSize != sizeof(CoreState) || header.romHash != romHash) {
+    return false;
+  }
+
+  // the whole file gets checked before any of its code is used
+  std::vector<PortableBlock> loaded;
+  for (u32 i = 0; i < header.count; i++) {
+    CachedBlock cached;
+    if (!get(&cached, sizeof(cached)) || cached.size > codeCapacity ||
+        cached.relocs > cached.size || cached.sites > cached.size) {
+      return false;
+    }
+    PortableBlock block{cached.start, cached.last, cached.cks};
+    block.code.resize(cached.size);
+    block.relocs.resize(cached.relocs);
+    block.sites.resize(cached.sites);
+    if (!get(block.code.data(), block.code.size()) || !get(block.relocs.data(), block.relocs.size() * sizeof(Reloc)) ||
+        !get(block.sites.data(), block.sites.size() * sizeof(PortableSite)) || !validBlock(block)) {
+      return false;
+    }
+    loaded.push_back(std::move(block));
+  }
+
+  for (auto& block : loaded) {
+    // skip blocks whose guest code changed, or that got compiled already
+    size_t len = std::min<size_t>(block.last + 2u, 0x1000) - block.start;
+    if (block.start >= 0x1000 || block.last < block.start || lookupBlock(block.start) ||
+        u32(hashBytes(&ram[block.start], len)) != block.cks) {
+      continue;
+    }
+    if (!importBlock(block)) break;
+  }
+  return true;
+}
+
+// Copies the compiled block at start out of the code cache, with its exits
+// pointing back at their unlinked stubs.
+PortableBlock CoreState::exportBlock(u16 start) const {
+  auto& block = blocks[start];
+  auto func = lookupBlock(start);
+  PortableBlock exported{start, u16(block.end_addr), block.cks, {func, func + block.size}, block.relocs};
+  for (auto& site : linksFrom[start]) {
+    PortableSite unlinked{u32(site.jmp - func), u32(site.unlinked - func), site.target};
+    s32 rel = s32(unlinked.unlinked - (unlinked.jmp + 5));
+    memcpy(&exported.code[unlinked.jmp + 1], &rel, sizeof(rel));
+    exported.sites.push_back(unlinked);
+  }
+  return exported;
+}
+
+// Installs a block exported from this or another CoreState, pointing its
+// stub jumps at our stubs and linking its exits. Returns false when it
+// doesn't fit in the code cache.
+bool CoreState::importBlock(const PortableBlock& block) {
+  if (gen->getSize() + block.code.size() > codeCapacity) return false;
+  auto func = gen->getCurr();
+  for (u8 byte : block.code) gen->db(byte);
+  auto dest = const_cast<u8*>(func);
+  for (auto& reloc : block.relocs) {
+    s32 rel = s32(stubAddress(reloc.stub) - (dest + reloc.offset + 4));
+    memcpy(dest + reloc.offset, &rel, sizeof(rel));
+  }
+  for (auto& site : block.sites) {
+    addLink({dest + site.jmp, dest + site.unlinked, block.start, site.target});
+  }
+  compileSrc = ram;
+  compileBase = 0;
+  relocs = block.relocs;
+  if (!installBlock(block.start, block.last, func, u32(block.code.size()))) gen->setSize(func - gen->getCode());
+  return true;
+}
+
+// Recovers the control-flow graph of the program from 0x200, following
+// static control flow: jumps, calls, the return points after calls and
+// draws, and falling through into the next block. Whatever it doesn't
+// reach is taken for data, like sprites, and so are blocks with an
+// instruction that isn't implemented.
+void CoreState::recoverCfg() {
+  // blockEnd reads through compileSrc, which the compile worker repoints
+  std::lock_guard<std::mutex> lock(jitMutex);
+  cfg.clear();
+  std::vector<u16> work{0x200};
+  std::vector<bool> seen(0x1000);
+  compileSrc = ram;
+  compileBase = 0;
+  while (!work.empty()) {
+    u16 pc = work.back();
+    work.pop_back();
+    if (pc > 0xffe || seen[pc]) continue;
+    seen[pc] = true;
+
+    CfgBlock block{pc, blockEnd(pc)};
+    bool valid = true;
+    for (u16 addr = pc;; addr += 2) {
+      u16 op = opAt(addr);
+      bool skipped = isSkip(op) && addr < block.last;
+      if (skipped) {
+        addr += 2;
+        valid = valid && isValidOp(op);
+        op = opAt(addr);
+      }
+      valid = valid && isValidOp(op);
+      if ((op & 0xf000) == 0x1000 || (op & 0xf000) == 0x2000) block.successors.push_back(op & 0xfff);
+      bool jumps = (op & 0xf000) == 0x1000 || (op & 0xf000) == 0xB000 || op == 0x00EE;
+      bool last = addr == block.last;
+      if ((endsBlock(op) && !jumps) || (last && (skipped || !endsBlock(op)))) block.successors.push_back(addr + 2);
+      // a skip the block ends on may also jump over what follows it
+      if (last && isSkip(op)) block.successors.push_back(addr + 4);
+      if (last) break;
+    }
+    if (!valid) continue;
+    work.insert(work.end(), block.successors.begin(), block.successors.end());
+    cfg.push_back(std::move(block));
+  }
+  std::sort(cfg.begin(), cfg.end(), [](const CfgBlock& a, const CfgBlock& b) { return a.start < b.start; });
+}
+
+// Workers compile into a scratch CoreState each, holding a copy of RAM, and
+// export every block as soon as it is done; this thread installs and links
+// them all afterwards, as if they had been loaded from a code cache.
+void CoreState::Precompile(unsigned threads) {
+  if (asyncCompile || sharedRom || aotCode) return;
+  std::vector<u16> starts;
+  for (auto& block : cfg) {
+    if (!lookupBlock(block.start)) starts.push_back(block.start);
+  }
+  if (starts.empty()) return;
+  threads = std::clamp<unsigned>(threads, 1, u32(starts.size()));
+
+  std::vector<PortableBlock> compiled(starts.size());
+  std::atomic<size_t> next{0};
+  auto compile = [&] {
+    auto scratch = std::make_unique<CoreState>(kMinCodeCacheSize);
+    memcpy(scratch->ram, ram, sizeof(ram));
+    scratch->quirks = quirks;
+    scratch->buildingImage = buildingImage;
+    for (size_t i; (i = next++) < starts.size();) {
+      scratch->CompileBlock(starts[i]);
+      compiled[i] = scratch->exportBlock(starts[i]);
+      scratch->evictBlock(starts[i]);
+      scratch->gen->setSize(scratch->stubsSize);
+    }
+  };
+  std::vector<std::thread> workers;
+  for (unsigned i = 1; i < threads; i++) workers.emplace_back(compile);
+  compile();
+  for (auto& worker : workers) worker.join();
+
+  std::lock_guard<std::mutex> lock(jitMutex);
+  for (auto& block : compiled) {
+    if (!importBlock(block)) break;
+    compiles++;
+  }
+}
+
+// Layout of an ahead-of-time image: a header, an AotBlock per block, and
+// the code cache it was compiled into, stubs included. The code only
+// reaches the CoreState through contextPtr and jumps within itself, so it
+// runs wherever the image gets loaded.
+struct AotHeader {
+  char magic[4];
+  u32 version, features, quirks, contextSize, count;
+  u64 romHash;
+  u32 codeOffset, codeSize;
+};
+
+struct AotBlock {
+  u16 start, last;
+  u32 cks, offset, size; // offset from the start of the image
+};
+
+std::vector<u8> CoreState::BuildAotImage() {
+  if (asyncCompile || sharedRom) return {};
+  FlushCodeCache();
+  // installing them in one go links every block to its static successors
+  buildingImage = true;
+  Precompile();
+  buildingImage = false;
+  std::vector<u16> starts;
+  for (auto& block : cfg) {
+    if (!lookupBlock(block.start)) return {};
+    starts.push_back(block.start);
+  }
+
+  std::vector<AotBlock> entries;
+  u32 codeOffset = u32(sizeof(AotHeader) + starts.size() * sizeof(AotBlock) + 63) & ~63u;
+  auto code = gen->getCode();
+  for (u16 start : starts) {
+    auto& block = blocks[start];
+    entries.push_back({start, u16(block.end_addr), block.cks, u32(codeOffset + (lookupBlock(start) - code)), block.size});
+  }
+  AotHeader header{{'J', '8', 'A', 'O'}, kJitVersion, hostFeatures, quirks, u32(sizeof(CoreState)), u32(entries.size()), romHash,
+                   codeOffset, u32(gen->getSize())};
+
+  std::vector<u8> image(codeOffset + gen->getSize());
+  memcpy(image.data(), &header, sizeof(header));
+  memcpy(image.data() + sizeof(header), entries.data(), entries.size() * sizeof(AotBlock));
+  memcpy(image.data() + codeOffset, code, gen->getSize());
+  FlushCodeCache();
+  return image;
+}
+
+bool CoreState::LoadAotImage(const void* image) {
+  if (asyncCompile || sharedRom) return false;
+  auto base = static_cast<const u8*>(image);
+  AotHeader header;
+  memcpy(&header, base, sizeof(header));
+  if (memcmp(header.magic, "J8AO", 4) != 0 || header.version != kJitVersion ||
+      header.features != hostFeatures || header.quirks != quirks || header.contextSize != sizeof(CoreState) || header.romHash != romHash) {
+    return false;
+  }
+  std::vector<AotBlock> entries(header.count);
+  memcpy(entries.data(), base + sizeof(header), entries.size() * sizeof(AotBlock));
+  // the blocks are linked to each other, so they are only usable together
+  for (auto& entry : entries) {
+    size_t len = std::min<size_t>(entry.last + 2u, 0x1000) - entry.start;
+    if (u32(hashBytes(&ram[entry.start], len)) != entry.cks) return false;
+  }
+
+  FlushCodeCache();
+  aotCode = base + header.codeOffset;
+  aotSize = header.codeSize;
+  compileSrc = ram;
+  compileBase = 0;
+  for (auto& entry : entries) {
+    relocs.clear();
+    installBlock(entry.start, entry.last, base + entry.offset, entry.size);
+  }
+  // nothing gets compiled while the image is in use
+  gen->setProtectModeRE(false);
+  return true;
+}
+
+bool CoreState::inImage(const u8* func) const {
+  return aotCode && func >= aotCode && func < aotCode + aotSize;
+}
+
+// Image blocks can't be unlinked, so a store into any of them retires the
+// whole image, and the JIT takes over again.
+void CoreState::dropImage() {
+  for (u16 start = 0; start < 0x1000; start++) {
+    if (inImage(lookupBlock(start))) evictBlock(start);
+  }
+  aotCode = nullptr;
+  gen->setProtectMode(Xbyak::CodeGenerator::PROTECT_RWE);
+}
+
+// Moves block compilation to a background thread. Blocks keep running in
+// the interpreter until the worker publishes their code, and are never
+// linked, since patching code another thread may be running isn't safe.
+void CoreState::StartCompileWorker() {
+  if (asyncCompile || sharedRom) return;
+  // drop the linked blocks compiled so far
+  FlushCodeCache();
+  asyncCompile = true;
+  stopWorker = false;
+  worker = std::thread(&CoreState::compileWorker, this);
+}
+
+void CoreState::StopCompileWorker() {
+  if (!asyncCompile) return;
+  {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    stopWorker = true;
+  }
+  queueCv.notify_one();
+  worker.join();
+  asyncCompile = false;
+  queueTail = queueHead.load();
+  for (auto& flag : queued) flag = false;
+}
+
+// Queues the block at pc for the worker, along with the guest code it
+// covers as of now. Requests that don't fit get retried on a later miss.
+void CoreState::requestCompile(u16 pc) {
+  if (queued[pc].exchange(true)) return;
+  u32 head = queueHead.load(std::memory_order_relaxed);
+  if (head - queueTail.load(std::memory_order_acquire) == kCompileQueueSize) {
+    queued[pc] = false;
+    return;
+  }
+  auto& request = compileQueue[head % kCompileQueueSize];
+  size_t len = std::min<size_t>(sizeof(request.code), 0x1000 - pc);
+  request.pc = pc;
+  memcpy(request.code, &ram[pc], len);
+  memset(request.code + len, 0, sizeof(request.code) - len);
+  queueHead.store(head + 1, std::memory_order_release);
+  {
+    std::lock_guard<std::mutex> lock(queueMutex);
+  }
+  queueCv.notify_one();
+}
+
+void CoreState::compileWorker() {
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(queueMutex);
+      queueCv.wait(lock, [this] {
+        return stopWorker || queueTail.load(std::memory_order_relaxed) != queueHead.load(std::memory_order_acquire);
+      });
+      if (stopWorker) return;
+    }
+    u32 tail = queueTail.load(std::memory_order_relaxed);
+    auto& request = compileQueue[tail % kCompileQueueSize];
+    u16 pc = request.pc;
+    {
+      std::lock_guard<std::mutex> lock(jitMutex);
+      if (table[pc].load(std::memory_order_relaxed) == compileStub && !flushPending) {
+        compileSrc = request.code;
+        compileBase = pc;
+        size_t mark = gen->getSize();
+        try {
+          u16 last;
+          auto func = emitBlock(pc, last);
+          compiles++;
+          if (!installBlock(pc, last, func, u32(gen->getCurr() - func))) gen->setSize(mark);
+        } catch (Xbyak::Error& e) {
+          if (e != Xbyak::ERR_CODE_IS_TOO_BIG) throw;
+          // only the main thread can flush, once it is out of JIT code
+          gen->setSize(mark);
+          flushPending = true;
+        }
+      }
+    }
+    queued[pc] = false;
+    queueTail.store(tail + 1, std::memory_order_release);
+  }
+}
+
+SharedCodeCache::SharedCodeCache() {
+  gen.setProtectMode(Xbyak::CodeGenerator::PROTECT_RWE);
+}
+
+SharedCodeCache& SharedCodeCache::Get() {
+  static SharedCodeCache cache;
+  return cache;
+}
+
+SharedRom* SharedCodeCache::Rom(u64 hash, u32 quirks) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto& rom : roms) {
+    if (rom->hash == hash && rom->quirks == quirks) return rom.get();
+  }
+  roms.push_back(std::make_unique<SharedRom>());
+  roms.back()->hash = hash;
+  roms.back()->quirks = quirks;
+  return roms.back().get();
+}
+
+// Switches to the shared stubs and drops the private blocks, which are
+// linked to each other and to the private stubs.
+void CoreState::ShareCode() {
+  if (asyncCompile || sharedRom) return;
+  auto& shared = SharedCodeCache::Get();
+  {
+    std::lock_guard<std::mutex> lock(shared.mutex);
+    if (!shared.stubs.entry) {
+      auto own = gen;
+      gen = &shared.gen;
+      EmitDispatcher();
+      gen = own;
+      shared.stubs = {jitEntry, dispatcher, dispatchExit, smcExit, compileStub};
+    }
+  }
+  useStubs(shared.stubs);
+  FlushCodeCache();
+  sharedRom = shared.Rom(romHash, quirks);
+}
+
+// Back to private code once the shared cache is full. Shared blocks keep
+// working from the private stubs, but get dropped along with the rest.
+void CoreState::stopSharing() {
+  sharedRom = nullptr;
+  useStubs(ownStubs);
+  FlushCodeCache();
+}
+
+// The shared block at pc compiled from the guest code RAM holds now.
+const SharedBlock* CoreState::findShared(u16 pc) const {
+  for (auto block = sharedRom->blocks[pc].load(std::memory_order_acquire); block; block = block->next) {
+    auto& guest = block->guest;
+    if (memcmp(&ram[pc], guest.data(), guest.size()) == 0) return block;
+  }
+  return nullptr;
+}
+
+// Compiles the block at pc into the shared cache and publishes it, or
+// returns nullptr when it doesn't fit. Runs with the shared mutex held.
+const SharedBlock* CoreState::emitShared(u16 pc) {
+  auto& shared = SharedCodeCache::Get();
+  auto own = gen;
+  gen = &shared.gen;
+  size_t mark = gen->getSize();
+  u16 last;
+  const u8* func;
+  try {
+    func = emitBlock(pc, last);
+  } catch (Xbyak::Error& e) {
+    gen->setSize(mark);
+    gen = own;
+    if (e != Xbyak::ERR_CODE_IS_TOO_BIG) throw;
+    return nullptr;
+  }
+  u32 size = u32(gen->getCurr() - func);
+  gen = own;
+  compiles++;
+
+  size_t len = std::min<size_t>(last + 2u, 0x1000) - pc;
+  auto& head = sharedRom->blocks[pc];
+  shared.blocks.push_back(std::make_unique<SharedBlock>(SharedBlock{
+    last, {&ram[pc], &ram[pc] + len}, func, size, relocs, head.load(std::memory_order_relaxed)}));
+  head.store(shared.blocks.back().get(), std::memory_order_release);
+  return shared.blocks.back().get();
+}
+
+// Takes the block at pc from the shared cache, compiling it there first
+// when no instance did yet.
+const u8* CoreState::compileShared(u16 pc) {
+  auto block = findShared(pc);
+  if (!block) {
+    std::lock_guard<std::mutex> lock(SharedCodeCache::Get().mutex);
+    // another instance may have compiled it meanwhile
+    block = findShared(pc);
+    if (!block) block = emitShared(pc);
   }
-}
\ No newline at end of file
+  if (!block) {
+    stopSharing();
+    return nullptr;
+  }
+  relocs = block->relocs;
+  if (!installBlock(pc, block->last, block->code, block->size)) return lookupBlock(pc);
+  return block->code;
+}
+
+// Called on a block table miss. Returns the code of the block at pc, or
+// nullptr while it has been entered fewer than hotThreshold times or is
+// being compiled in the background.
+const u8* CoreState::blockMiss(u16 pc) {
+  // an image runs without the compiler; what it misses, like Bnnn
+  // targets, gets interpreted
+  if (aotCode) {
+    coldExit = true;
+    return nullptr;
+  }
+  // jumps saved before the block got compiled, like 2nnn return points,
+  // still go through compileStub
+  if (auto func = lookupBlock(pc)) return func;
+  // code another instance compiled already is free to take
+  if (sharedRom && findShared(pc)) return CompileBlock(pc);
+  bool hot = ++hotness[pc] >= hotThreshold;
+  if (hot && !asyncCompile) return CompileBlock(pc);
+  if (hot) requestCompile(pc);
+  coldExit = true;
+  return nullptr;
+}
+
+// Runs the cold block at PC through the interpreter and charges it to the
+// budget. Returns true when it ended on an instruction the host has to see.
+bool CoreState::interpretBlock() {
+  for (int count = 0; count < BLOCK_MAX_INSTRS && budget > 0; count++) {
+    u16 op = bswap_16(*reinterpret_cast<u16*>(&ram[PC]));
+    RunInterpreter();
+    budget--;
+    if (op == 0x00E0 || (op & 0xf000) == 0xD000) return true;
+    if (endsBlock(op) && !isSkip(op)) break;
+  }
+  return false;
+}
+
+u32 CoreState::RunFor(u32 instructions) {
+  budget = instructions;
+  if (flushPending) FlushCodeCache();
+  while (budget > 0) {
+    coldExit = false;
+    cycleBase = cycles + budget;
+    jitEntry(this);
+    cycles = cycleBase - budget;
+    if (!coldExit || interpretBlock()) break;
+  }
+  return instructions - budget;
+}
+
+void CoreState::RunFrame() {
+  // instructions overshot by the last block of a frame come out of the next one
+  s32 frame = s32(kTimersRate) - frameDebt;
+  while (frame > 0) {
+    frame -= RunFor(frame);
+  }
+  frameDebt = -frame;
+}
+
+void CoreState::RunJit() {
+  RunFor(1);
+}
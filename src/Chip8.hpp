@@ -3,6 +3,12 @@
 #include <filesystem>
 #include <xbyak.h>
 #include <cstring>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <memory>
 
 #define bswap_16(x) (((x) << 8) | ((x) >> 8))
 
@@ -19,43 +25,200 @@ using s8 = int8_t;
 using s16 = int16_t;
 using s32 = int32_t;
 
+// The 60Hz timers tick every kCyclesPerTick executed instructions
+constexpr u64 kCyclesPerTick = u64(kTimersRate);
+
+// Bytes of host code a CoreState may hold before it flushes its compiled
+// blocks. The minimum leaves room for the stubs and the largest block.
+constexpr size_t kDefaultCodeCacheSize = 1 << 20;
+constexpr size_t kMinCodeCacheSize = 64 << 10;
+
+// Bytes of host code the process-wide SharedCodeCache holds
+constexpr size_t kSharedCodeCacheSize = 16 << 20;
+
+// Times a block is interpreted before it gets compiled
+constexpr u32 kDefaultHotThreshold = 8;
+// Blocks waiting for the background compile worker
+constexpr u32 kCompileQueueSize = 64;
+
+// Version of the emitted code. Bump it whenever what the emitter produces
+// or the CoreState layout changes, so persisted code caches get ignored.
+constexpr u32 kJitVersion = 8;
+
 #ifdef _WIN32
 #define contextPtr gen->r10
 #define reg_PC gen->ax
-#define reg_VX gen->rcx.cvt8()
-#define reg_VY gen->rdx.cvt8()
-#define reg_VF gen->r8.cvt8()
+#define reg_cycles gen->r15d
 #define arg1 gen->rcx
 #define arg2 gen->rdx
 #define arg3 gen->r8
 #define arg4 gen->r9
+// Stack slot jitEntry keeps the context in, past the shadow space
+#define contextSlot gen->qword[gen->rsp + 32]
+// Host registers the block allocator hands out to guest V registers.
+// The first ALLOC_CALLEE_SAVED survive helper calls, the rest get spilled.
+#define ALLOC_REGS { \
+  Xbyak::Operand::RBX, Xbyak::Operand::RBP, Xbyak::Operand::RSI, Xbyak::Operand::RDI, \
+  Xbyak::Operand::R12, Xbyak::Operand::R13, Xbyak::Operand::R14, \
+  Xbyak::Operand::RCX, Xbyak::Operand::RDX, Xbyak::Operand::R8 }
+#define ALLOC_CALLEE_SAVED 7
 #else
 #define contextPtr gen->r10
 #define reg_PC gen->ax
-#define reg_VX gen->rdi.cvt8()
-#define reg_VY gen->rsi.cvt8()
-#define reg_VF gen->rdx.cvt8()
+#define reg_cycles gen->r15d
 #define arg1 gen->rdi
 #define arg2 gen->rsi
 #define arg3 gen->rdx
 #define arg4 gen->rcx
 #define arg5 gen->r8
 #define arg6 gen->r9
+// Stack slot jitEntry keeps the context in, the one it pads rsp with
+#define contextSlot gen->qword[gen->rsp]
+#define ALLOC_REGS { \
+  Xbyak::Operand::RBX, Xbyak::Operand::RBP, Xbyak::Operand::R12, Xbyak::Operand::R13, \
+  Xbyak::Operand::R14, \
+  Xbyak::Operand::RSI, Xbyak::Operand::RDI, Xbyak::Operand::RDX, Xbyak::Operand::RCX, Xbyak::Operand::R8 }
+#define ALLOC_CALLEE_SAVED 5
 #endif
-#define BLOCKS_SIZE 0x700
-#define BLOCKS_DSIZE ((BLOCKS_SIZE) - 1)
+// Longest run of guest instructions compiled into one block
+#define BLOCK_MAX_INSTRS 64
+// Targets a Bnnn remembers before it leaves the rest to the dispatcher
+constexpr int kJumpCacheWays = 4;
+
+// The rel32 of a jump from block code to one of the stubs, the only
+// address block code holds that depends on where it was emitted.
+struct Reloc {
+  u32 offset; // from the start of the block's code
+  u8 stub;    // see CoreState::stubAddress
+};
 
+// Metadata of the compiled block starting at a given address. The code
+// itself is only reachable through the block table.
 struct BasicBlock {
-  u32 cks{}, start_addr{}, end_addr{};
-  void(*func)() = nullptr;
+  u32 cks{}, end_addr{};
+  u32 size{}; // bytes of host code
+  std::vector<Reloc> relocs;
+};
+
+// Compiled blocks are bare code entered by jumps from the dispatcher or from
+// linked exits, with host state saved once by the entry trampoline:
+//   contextPtr  this CoreState, also kept in contextSlot so it can be
+//               reloaded after helper calls; block code embeds no pointer
+//               to it, and reaches helpers through its helpers[] table
+//   reg_PC      guest PC on the way into the dispatcher
+//   reg_cycles  instructions left in the RunFor budget; each block exit
+//               subtracts what ran on its path
+//   rsp         16-byte aligned (plus shadow space on Windows) for helper calls
+// Every other host register is free for the block to use.
+
+// A block exit with a static target. jmp is a patchable jmp rel32 that
+// points at the unlinked exit stub until the target block gets compiled.
+struct LinkSite {
+  u8* jmp;
+  const u8* unlinked;
+  u16 owner, target;
+};
+
+// A block for the background compile worker, with the guest code it
+// covers copied out of RAM when it was requested. A skip as the last
+// instruction takes the one it skips into the block, hence the extra one.
+struct CompileRequest {
+  u16 pc;
+  u8 code[(BLOCK_MAX_INSTRS + 1) * 2];
+};
+
+// A compiled block in a form any CoreState can install: its code with the
+// exits unlinked, where that code jumps to the stubs, and its exits.
+struct PortableSite {
+  u32 jmp, unlinked; // offsets from the start of the block's code
+  u16 target;
+};
+
+struct PortableBlock {
+  u16 start, last;
+  u32 cks;
+  std::vector<u8> code;
+  std::vector<Reloc> relocs;
+  std::vector<PortableSite> sites;
+};
+
+// A block of the ROM's control-flow graph, recovered by LoadProgram.
+// Computed jumps (Bnnn) and returns have no static successors; a return
+// leads to the block after its call instead.
+struct CfgBlock {
+  u16 start, last;
+  std::vector<u16> successors;
+};
+
+struct CoreState;
+
+// Entry points emitted by EmitDispatcher. They only reach the CoreState they
+// run for through contextPtr, so a CoreState can run on any copy of them.
+struct JitStubs {
+  void(*entry)(CoreState*);
+  const u8 *dispatcher, *dispatchExit, *smcExit, *compileStub;
+};
+
+// A block in the SharedCodeCache, compiled from the guest code in guest.
+struct SharedBlock {
+  u16 last;
+  std::vector<u8> guest;
+  const u8* code;
+  u32 size;
+  std::vector<Reloc> relocs;
+  const SharedBlock* next; // compiled earlier at the same address
+};
+
+// Blocks of one ROM in the SharedCodeCache, by the address they start at.
+struct SharedRom {
+  u64 hash;
+  u32 quirks;
+  std::atomic<const SharedBlock*> blocks[0x1000]{};
+};
+
+// Code cache for the whole process, used by every CoreState that called
+// ShareCode, so instances running the same ROM compile each block once.
+// Lookups are lock-free: a block gets published with a release store of
+// the head of its address' list, and published code is never patched or
+// freed, which is also why shared blocks aren't linked. Compiling into it
+// takes mutex. Once it fills up, instances go back to private code.
+struct SharedCodeCache {
+  static SharedCodeCache& Get();
+  SharedRom* Rom(u64 hash, u32 quirks);
+
+  std::mutex mutex;
+  Xbyak::CodeGenerator gen{kSharedCodeCacheSize};
+  JitStubs stubs{};
+  std::vector<std::unique_ptr<SharedRom>> roms;
+  std::vector<std::unique_ptr<SharedBlock>> blocks;
+private:
+  SharedCodeCache();
+};
+
+struct CodeCacheStats {
+  size_t capacity, used; // bytes, stubs included
+  u32 blocks;            // blocks currently compiled
+  u32 compiles, flushes; // since construction
+};
+
+// Behaviours CHIP-8 interpreters disagree on, see CoreState::SetQuirks
+enum Quirk : u32 {
+  // Fx55/Fx65 leave I pointing past the last register transferred
+  QuirkLoadStoreIncrementsI = 1,
 };
 
 struct CoreState {
   u16 PC = 0x200, ip = 0, stack[16]{};
   u8 ram[0x1000]{}, v[16]{}, sp = 0, delay = 0, sound = 0;
-  u32 cycles = 0;
-  u64 display[32]{};
+  // Instructions executed so far. delay and sound hold the value last
+  // written, at the cycle count in delayStamp/soundStamp; the current value
+  // is derived from the ticks elapsed since then.
+  u64 cycles = 0, delayStamp = 0, soundStamp = 0;
+  alignas(32) u64 display[32]{};
   bool draw = false;
+  // Blocks run in the interpreter until they have been entered this many
+  // times; 0 or 1 compiles everything on first use.
+  u32 hotThreshold = kDefaultHotThreshold;
   static constexpr u8 font[80] = {
     0xF0, 0x90, 0x90, 0x90, 0xF0, //0
     0x20, 0x60, 0x20, 0x20, 0x70, //1
@@ -75,41 +238,217 @@ struct CoreState {
     0xF0, 0x80, 0xF0, 0x80, 0x80  //F
   };
 
-  CoreState();
+  explicit CoreState(size_t codeCacheSize = kDefaultCodeCacheSize);
+  ~CoreState();
 
   bool LoadProgram(const fs::path&);
+  // Persisted code cache: one file per ROM in dir, keyed by a hash of the
+  // ROM and kJitVersion. Loading installs every block whose guest code still
+  // matches its checksum, so a warm start compiles nothing.
+  // Files are only used from a directory and file of the current user that
+  // nobody else can write to.
+  bool LoadCodeCache(const fs::path& dir);
+  bool SaveCodeCache(const fs::path& dir) const;
+  // The per-user directory for code cache files, $XDG_CACHE_HOME/jit8 or
+  // ~/.cache/jit8, created private to the user. Empty when there is none.
+  static fs::path CodeCacheDir();
   void RunInterpreter();
+  // Runs guest code, compiled or interpreted while still cold, until about
+  // `instructions` guest instructions have executed or a draw happened,
+  // and returns how many actually ran.
+  u32 RunFor(u32 instructions);
+  // Runs one 60Hz frame worth of instructions.
+  void RunFrame();
   void RunJit();
   void dxyn(u8, u8, u8);
+  u8 DelayAt(u64) const;
+  u8 SoundAt(u64) const;
+  void FlushCodeCache();
+  CodeCacheStats CacheStats() const;
+  void StartCompileWorker();
+  void StopCompileWorker();
+  // Ahead-of-time compiled code: BuildAotImage compiles every block
+  // reachable from 0x200 into an image that jit8-aot wraps in an object
+  // file. LoadAotImage runs the blocks straight from a linked-in image, and
+  // compiles nothing while the image is in use.
+  std::vector<u8> BuildAotImage();
+  bool LoadAotImage(const void*);
+  // Compiles every block of the program found by LoadProgram that isn't
+  // compiled yet, spread over threads.
+  void Precompile(unsigned threads = std::thread::hardware_concurrency());
+  // Compiles into and runs blocks from the SharedCodeCache from now on.
+  // Not available together with the compile worker.
+  void ShareCode();
+  // Selects Quirk behaviours, which compiled code bakes in, so changing
+  // them drops the compiled blocks.
+  void SetQuirks(u32);
 private:
   template <typename T>
-  void emitMemberCall(T func, void* thisObject) {
-    void* functionPtr;
-    auto thisPtr = reinterpret_cast<uintptr_t>(thisObject);
-
+  static void* memberFunctionAddress(T func) {
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
     static_assert(sizeof(T) == 8, "[x64 JIT] Invalid size for member function pointer");
-        std::memcpy(&functionPtr, &func, sizeof(T));
+    void* functionPtr;
+    std::memcpy(&functionPtr, &func, sizeof(T));
+    return functionPtr;
 #else
     static_assert(sizeof(T) == 16, "[x64 JIT] Invalid size for member function pointer");
     uintptr_t arr[2];
     std::memcpy(arr, &func, sizeof(T));
     // First 8 bytes correspond to the actual pointer to the function
-    functionPtr = reinterpret_cast<void*>(arr[0]);
-    // Next 8 bytes correspond to the "this" pointer adjustment
-    thisPtr += arr[1];
+    return reinterpret_cast<void*>(arr[0]);
 #endif
-
-    gen->mov(arg1.cvt64(), thisPtr);
-    gen->mov(contextPtr, (uintptr_t)functionPtr);
-    gen->call(contextPtr);
-    gen->mov(contextPtr, (uintptr_t)this);
   }
 
+  // Functions JIT code calls, through helpers[]. The ones from HelperDxyn
+  // on are CoreState members and get the context as their this.
+  enum Helper : u8 {
+    HelperRand,
+    HelperDxyn, HelperFx55, HelperFx65, HelperDelayAt, HelperDelayWaitSkip,
+    HelperInvalidateRange, HelperBlockMiss, HelperJumpCacheMiss,
+    HelperCount
+  };
+  const void* helpers[HelperCount]{};
+  void EmitCall(Helper);
+
+  // Relocatable code
+  u64 romHash = 0;
+  size_t blockMark = 0;       // gen size where the block being emitted starts
+  std::vector<Reloc> relocs;  // relocations of the block being emitted
+  const u8* stubAddress(u8) const;
+  void EmitStubJmp(const u8*);
+
+  u32 quirks = 0;
   void Fx33(u8);
+  void Fx55(u8);
+  void Fx65(u8);
   void invalidate(u16);
-  BasicBlock cache[BLOCKS_SIZE]{};
-  u8* code{};
+  void invalidateRange(u16, u16);
+  void evictBlock(u16);
+  // Direct-mapped block table with an entry per guest address, so the
+  // dispatcher jumps through table[PC] with no tag check; blocks[] keeps
+  // the metadata off the hot path.
+  std::atomic<const u8*> table[0x1000];
+  BasicBlock blocks[0x1000]{};
+  // Start addresses of the compiled blocks covering each byte of RAM
+  std::vector<u16> blocksAt[0x1000];
+  // One bit per RAM byte covered by compiled code, padded so JIT code can
+  // load a dword at any byte index
+  u8 codeMap[0x1000 / 8 + 4]{};
   Xbyak::CodeGenerator* gen;
-  void EmitInstruction(u16);
+  size_t codeCapacity = 0, stubsSize = 0;
+  u32 compiles = 0, flushes = 0;
+  const u8* CompileBlock(u16);
+  const u8* emitBlock(u16, u16&);
+  bool installBlock(u16, u16, const u8*, u32);
+  // Where the compiler reads guest code: compileSrc[addr - compileBase]
+  const u8* compileSrc = ram;
+  u16 compileBase = 0;
+  u16 opAt(u16) const;
+
+  // Tiered execution
+  u32 hotness[0x1000]{};
+  bool coldExit = false;
+  const u8* blockMiss(u16);
+  bool interpretBlock();
+
+  // Background compilation. The worker owns gen and the compiler state
+  // while it holds jitMutex, which also guards block metadata; the
+  // dispatcher reads table[] without it. Requests travel through a
+  // single-producer single-consumer ring.
+  bool asyncCompile = false, stopWorker = false;
+  std::atomic<bool> flushPending{false};
+  std::atomic<bool> queued[0x1000]{};
+  CompileRequest compileQueue[kCompileQueueSize]{};
+  std::atomic<u32> queueHead{0}, queueTail{0};
+  mutable std::mutex jitMutex;
+  std::mutex queueMutex;
+  std::condition_variable queueCv;
+  std::thread worker;
+  void requestCompile(u16);
+  void compileWorker();
+  u16 blockEnd(u16);
+  void EmitInstruction(u16, u16);
+  void EmitSkip(u16, Xbyak::Label&);
+
+  // In-JIT dispatcher: blocks jump to dispatcher with the guest PC in reg_PC,
+  // dispatchExit stores it and returns from jitEntry to RunJit.
+  void(*jitEntry)(CoreState*){};
+  const u8* dispatcher{};
+  const u8* dispatchExit{};
+  const u8* smcExit{};
+  const u8* compileStub{};
+  JitStubs ownStubs{};
+  void EmitDispatcher();
+  void useStubs(const JitStubs&);
+
+  // Constants of the vectorized sprite blitter, see EmitDxyn
+  alignas(16) u8 nibbleReverse[16] = {0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE, 0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF};
+  alignas(16) u8 nibbleMask[16] = {0xF, 0xF, 0xF, 0xF, 0xF, 0xF, 0xF, 0xF, 0xF, 0xF, 0xF, 0xF, 0xF, 0xF, 0xF, 0xF};
+  u8 rowMask[32] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+  void EmitDxyn(u8, u8, u8);
+
+  // Ahead-of-time image in use, see LoadAotImage
+  const u8* aotCode = nullptr;
+  size_t aotSize = 0;
+  bool buildingImage = false; // image code can't be patched, see EmitJumpCache
+  bool inImage(const u8*) const;
+  void dropImage();
+
+  // Static analysis and eager compilation
+  std::vector<CfgBlock> cfg;
+  void recoverCfg();
+  PortableBlock exportBlock(u16) const;
+  bool importBlock(const PortableBlock&);
+
+  // Shared code, see SharedCodeCache
+  SharedRom* sharedRom = nullptr;
+  const SharedBlock* findShared(u16) const;
+  const SharedBlock* emitShared(u16);
+  const u8* compileShared(u16);
+  void stopSharing();
+
+  s32 budget = 0, frameDebt = 0;
+  u64 cycleBase = 0; // cycles + budget when JIT code was entered
+  void EmitNow(const Xbyak::Reg64&);
+  u32 delayWaitSkip(u64, s32, u32);
+  void EmitIdleSkip(u16);
+  u32 blockCount = 0; // instructions executed so far on the path being emitted
+  void EmitDispatch();
+  void EmitEventExit(u16);
+  void EmitStoreCheck(u16, u8, u8 = 0);
+  void EmitCopy(const Xbyak::RegExp&, const Xbyak::RegExp&, u8);
+
+  // Block linking
+  u16 blockStart = 0;
+  // Exits by the block they leave and by the block they enter, so
+  // (un)linking a block only visits its own exits and the jumps into it
+  std::vector<LinkSite> linksFrom[0x1000];
+  std::vector<LinkSite> linksTo[0x1000];
+  const u8* lookupBlock(u16) const;
+  void EmitLink(u16);
+  void addLink(const LinkSite&);
+  void dropLink(const LinkSite&);
+  void unlinkBlock(u16);
+  void EmitJumpCache();
+  void jumpCacheMiss(u8*, u16, u16);
+
+  // Return prediction: 2nnn records, at its stack depth, the address it
+  // returns to and the table entry of the block there, and 00EE jumps
+  // through that entry when the address it pops matches. Evicting blocks
+  // points every entry back to the dispatcher.
+  u16 returnPC[16]{};
+  const u8* returnCode[16]{};
+  void forgetReturns();
+
+  // Block register allocation: hostReg[i] indexes ALLOC_REGS, or is -1 when
+  // V[i] stays in memory for the whole block.
+  static constexpr int kAllocRegs = 10;
+  static constexpr int allocRegs[kAllocRegs] = ALLOC_REGS;
+  s8 hostReg[16]{};
+  bool dirtyReg[16]{};
+  void AllocRegs(u16, u16);
+  void SpillRegs();
+  void ReloadRegs(u16);
+  Xbyak::Reg8 ReadV(u8, const Xbyak::Reg64&);
+  void WriteV(u8, const Xbyak::Reg8&);
 };
\ No newline at end of file